@@ -0,0 +1,50 @@
+#ifndef PUMP_MODEL_H
+#define PUMP_MODEL_H
+
+#include <stdint.h>
+
+// 預測式澆水的模型（pump_model.cpp），編譯時加上 -D PREDICTIVE_WATERING 才會使用。
+// 開始澆水後 M 要經過一個死區時間才開始以固定速率上升，停止澆水後也會再上升大約一個死區時間。
+// 不依賴 Arduino，可以在 [env:native] 上測試。
+
+// M 比開始澆水時高出多少才算土壤開始反應（用來量測死區時間）
+#define PUMP_RISE_THRESHOLD 2
+// 量測上升速率所需的最短時間
+#define PUMP_MODEL_MIN_SPAN_MS 2000
+// 新量測值在平滑後模型中的權重
+#define PUMP_MODEL_ALPHA 0.25
+// 依模型預定的最長澆水時間
+#define PUMP_MAX_ON_MS 300000
+
+typedef struct
+{
+  // 死區時間過後 M 每秒上升多少，0 代表還沒學到
+  float rate;
+  // 開始澆水到 M 開始上升的時間
+  uint32_t dead_time_ms;
+
+  // 本次澆水的量測狀態
+  unsigned long start_ms;
+  unsigned long rise_ms;
+  unsigned long on_ms;
+  unsigned long stop_ms;
+  uint8_t start_M;
+  uint8_t rise_M;
+  bool risen;
+  bool stop_scheduled;
+} PumpModel;
+
+// 開始澆水，已學到模型時排定停止時間
+void pump_model_start(PumpModel *model, uint8_t M, uint32_t U, unsigned long current_ms);
+// 澆水期間每次量到 M 時呼叫
+void pump_model_sample(PumpModel *model, uint8_t M, unsigned long current_ms);
+// 已學到模型時，判斷現在停止之後 M 是否會到達 U
+bool pump_model_should_stop(PumpModel *model, uint8_t M, uint32_t U, unsigned long current_ms);
+// 排定的停止時間到了
+bool pump_model_stop_due(PumpModel *model, unsigned long current_ms);
+// 停止後一個死區時間內水還在路上，M 還沒反應，不能依 M 重新開始澆水
+bool pump_model_can_start(PumpModel *model, unsigned long current_ms);
+// 停止澆水，依本次的量測更新模型，有更新時回傳 true
+bool pump_model_stop(PumpModel *model, uint8_t M, unsigned long current_ms);
+
+#endif
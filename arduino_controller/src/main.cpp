@@ -1,6 +1,12 @@
 #include <Arduino.h>
 #include <SoftwareSerial.h>
 
+#include "pump_model.h"
+#ifdef CONFIG_CACHE
+#include <EEPROM.h>
+#include <util/crc16.h>
+#endif
+
 #define RESET_PIN 7
 #define WATER_PUMP_PIN 5
 #define M01_SENSOR_PIN A5
@@ -14,16 +20,131 @@
 #define HEADER_SERVER_SET_CLIENT_CONFIG (uint8_t)112
 #define HEADER_SERVER_GET_CLIENT_CONFIG (uint8_t)113
 #define HEADER_CLIENT_GET_SERVER_CONFIG (uint8_t)114
+#define HEADER_CLIENT_SUBMIT_HEALTH (uint8_t)115
+#define HEADER_CLIENT_SUBMIT_PROFILE (uint8_t)116
+#define HEADER_CLIENT_SUBMIT_PUMP_MODEL (uint8_t)117
+#define HEADER_CLIENT_SUBMIT_PROBE_ALERT (uint8_t)118
+#define HEADER_SUBMIT_M_AT (uint8_t)119
 #define HEADER_ESP8266_LOG_MESSAGE (uint8_t)120
+#define HEADER_SERVER_DEBUG_GET_PROFILE (uint8_t)125
+#define HEADER_ESP8266_SLEEP (uint8_t)127
+#define HEADER_ESP8266_AWAKE (uint8_t)128
+#define HEADER_ESP8266_TIME (uint8_t)136
+#define HEADER_CLIENT_SUBMIT_QUEUE_STATS (uint8_t)138
+#define HEADER_BUS_POLL (uint8_t)141
+#define HEADER_BUS_POLL_END (uint8_t)142
 #define EOP (uint8_t)0x00
 
 // 檢查是否要澆水的頻率（正在澆水中）
 #define DETECT_INTERVAL_BUSY_MS 100
 // 檢查是否要澆水的頻率（待機中）
 #define DETECT_INTERVAL_IDLE_MS 10000
+// 檢查是否要澆水的頻率（正在澆水中，已學到澆水模型）
+#define DETECT_INTERVAL_VERIFY_MS 1000
 // 未初始化時提示訊息的頻率
 #define WAITING_LOG_INTERVAL_MS 3000
 #define PACKET_CONFIG_PAYLOAD_SIZE 16
+// 回報記憶體狀況的頻率
+#define HEALTH_REPORT_INTERVAL_MS 60000
+// 預測式澆水，編譯時加上 -D PREDICTIVE_WATERING 才會啟用，模型在 pump_model.cpp
+#define PACKET_PUMP_MODEL_PAYLOAD_SIZE 8
+// 感測器異常偵測，編譯時加上 -D PROBE_CHECK 才會啟用，異常時停止澆水並回報 server
+// 探針斷線或短路時 V_raw 會貼近 0 或 1023，M 會被限制在 0 或 100
+#define PROBE_RAW_MIN 8
+#define PROBE_RAW_MAX 1015
+// 連續多少次讀到完全相同的 V_raw 視為訊號卡住
+#define PROBE_FLATLINE_COUNT 180
+// 相鄰兩次量測之間 M 的最大合理變化
+#define PROBE_MAX_STEP 25
+// 澆水這麼久 M 都沒有上升，視為探針沒有插在土裡
+#define PROBE_NO_RESPONSE_MS 120000
+// 連續多少次正常的量測才解除異常
+#define PROBE_RECOVER_COUNT 10
+#define PROBE_OK 0
+#define PROBE_SATURATED 1
+#define PROBE_FLATLINE 2
+#define PROBE_SLOPE 3
+#define PROBE_NO_RESPONSE 4
+// PROBE_ALERT：status u8, V_raw u16, M u8，status 回到 PROBE_OK 時也會送出
+#define PACKET_PROBE_ALERT_PAYLOAD_SIZE 4
+// 時間同步，編譯時加上 -D CLOCK_SYNC 才會啟用（esp8266_tcp_client 也要一起開啟）
+// 收到 ESP8266_TIME（epoch_s u32, epoch_ms u16）之後，M 改用 SUBMIT_M_AT（M u8, epoch_s u32）附上量測時間
+#define PACKET_TIME_PAYLOAD_SIZE 6
+#define PACKET_M_AT_PAYLOAD_SIZE 5
+// 送給 ESP8266 的封包依優先順序排隊，控制封包優先於遙測封包，同一個封包送完才會換佇列。
+// 佇列中每個封包以 [封包長度 u8][排入時間 u16] 開頭
+#define ESP8266_TX_CONTROL_SIZE 32
+#define ESP8266_TX_TELEMETRY_SIZE 64
+#define TX_FRAME_HEADER_SIZE 3
+// SoftwareSerial 送出時會擋住 loop()（9600 baud 約 1 ms/byte），每輪 loop() 只送出一小段
+#define ESP8266_TX_BYTES_PER_LOOP 4
+#define TX_QUEUE_CONTROL 0
+#define TX_QUEUE_TELEMETRY 1
+#define TX_QUEUE_COUNT 2
+// QUEUE_STATS：每個佇列 max_depth u16, max_wait_ms u16, dropped u16，回報後歸零
+#define PACKET_QUEUE_STATS_PAYLOAD_SIZE (TX_QUEUE_COUNT * 6)
+// 低功耗模式，編譯時加上 -D LOW_POWER_MODE 才會啟用（esp8266_tcp_client 也要一起開啟）
+// ESP8266 睡著時封包留在佇列裡，拉低 ESP8266_EN_PIN 喚醒它，收到 AWAKE 之後再送出
+#define ESP8266_WAKE_PULSE_MS 10
+// 喚醒之後多久沒收到 AWAKE 就再喚醒一次
+#define ESP8266_WAKE_TIMEOUT_MS 3000
+// 把 server 給的 config 存在 EEPROM，編譯時加上 -D CONFIG_CACHE 才會啟用
+// 開機時先用上次的 config 開始運作，不用等 server（停電後所有裝置同時開機時 server 可能還沒恢復）。
+// 每次 config 改變時寫到下一個 slot，輪流使用整個 EEPROM 分散寫入次數，以 CRC 正確且 seq 最新的記錄為準，
+// 寫到一半斷電時上一筆記錄仍然有效
+#define CONFIG_CACHE_SLOT_COUNT ((E2END + 1) / sizeof(ConfigRecord))
+#define CONFIG_CACHE_NONE UINT8_MAX
+// 用 EEPROM 裡的 config 運作時，開機後向 server 要 config 的間隔，每次加倍，
+// 避免停電後所有裝置一起每 3 秒要一次。server 沒回應期間會一直用舊的 config 澆水
+#define CONFIG_REQUEST_RETRY_MS 3000
+#define CONFIG_REQUEST_MAX_RETRY_MS 600000UL
+// 多節點 serial bus（RS-485），編譯時加上 -D MULTIDROP_BUS 才會啟用（esp8266_tcp_client 也要一起開啟）
+// 每個封包前面加上 [節點位址][payload 長度]，封包留在佇列裡，被 ESP8266 poll 時才送出
+#define BUS_BROADCAST (uint8_t)0xFF
+#define RS485_DE_PIN 4
+// 節點位址由兩個跳線決定（接地為 1），位址 = 1 + NODE_ADDRESS_PIN_1 * 2 + NODE_ADDRESS_PIN_0，同一條 bus 上的節點要設成不同位址
+#define NODE_ADDRESS_PIN_0 8
+#define NODE_ADDRESS_PIN_1 9
+// 每次被 poll 時最多送出的佇列封包 bytes，超過的留到下次 poll。
+// esp8266_tcp_client 的 BUS_POLL_TIMEOUT_MS 要涵蓋這些 byte（9600 baud 約 1 ms/byte）和 profile 的傳送時間
+#define BUS_POLL_REPLY_MAX_BYTES 64
+#define BUS_RX_ADDRESS 0
+#define BUS_RX_LENGTH 1
+#define BUS_RX_FRAME 2
+// frame 內的 byte 是連續送出的，frame 中間安靜這麼久代表 frame 斷掉了（節點重啟、雜訊、ESP8266 開機時的輸出），
+// 丟掉收到一半的 frame，從下一個位址 byte 重新對齊
+#define BUS_RX_IDLE_RESET_MS 5
+
+#if defined(MULTIDROP_BUS) && defined(LOW_POWER_MODE)
+#error "MULTIDROP_BUS and LOW_POWER_MODE cannot be enabled together"
+#endif
+// 佇列裡最大的封包也要能在一次 poll 裡送出
+#if BUS_POLL_REPLY_MAX_BYTES < ESP8266_TX_TELEMETRY_SIZE - TX_FRAME_HEADER_SIZE
+#error "BUS_POLL_REPLY_MAX_BYTES must fit the largest queued frame"
+#endif
+
+// 用來偵測 stack 最高水位的填充值
+#define STACK_CANARY (uint8_t)0xA5
+
+// loop() 各階段的耗時統計，編譯時加上 -D PROFILE_LOOP 才會啟用
+// Timer1 除頻 8，每個 tick 0.5 us，16-bit 計數約 32 ms 溢位
+#define PROFILE_STAGE_LOOP 0
+#define PROFILE_STAGE_PARSE 1
+#define PROFILE_STAGE_GET_M 2
+#define PROFILE_STAGE_SERIAL_WRITE 3
+#define PROFILE_STAGE_COUNT 4
+#define PROFILE_BUCKET_COUNT 16
+#define PROFILE_BUCKET_SHIFT 0
+#define PROFILE_TICKS_PER_US 2
+#define PACKET_PROFILE_PAYLOAD_SIZE (5 + PROFILE_STAGE_COUNT * PROFILE_BUCKET_COUNT * 2)
+
+#ifdef PROFILE_LOOP
+#define PROFILE_BEGIN(stage) uint16_t profile_start_##stage = TCNT1
+#define PROFILE_END(stage) profile_record(stage, TCNT1 - profile_start_##stage)
+#else
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+#endif
 
 typedef struct
 {
@@ -32,6 +153,27 @@ typedef struct
   size_t payload_size;
 } Packet;
 
+typedef struct
+{
+  uint8_t *buffer;
+  uint8_t size;
+  uint8_t head;
+  uint8_t length;
+  // 上次回報之後的統計
+  uint8_t max_depth;
+  uint16_t max_wait_ms;
+  uint16_t dropped;
+} TxQueue;
+
+#ifdef CONFIG_CACHE
+typedef struct
+{
+  uint16_t seq;
+  uint8_t config[PACKET_CONFIG_PAYLOAD_SIZE];
+  uint16_t crc;
+} ConfigRecord;
+#endif
+
 bool config_inited = false;
 bool is_watering = false;
 
@@ -40,11 +182,124 @@ uint32_t L = 30;
 uint32_t U = 70;
 uint32_t I = 10000;
 
+#ifdef PREDICTIVE_WATERING
+PumpModel pump_model;
+#endif
+
+#ifdef PROBE_CHECK
+uint8_t probe_status = PROBE_OK;
+int probe_last_raw = -1;
+uint8_t probe_last_M = UINT8_MAX;
+uint16_t probe_flat_count = 0;
+uint8_t probe_normal_count = 0;
+unsigned long probe_pump_start_ms = 0;
+uint8_t probe_pump_start_M = 0;
+#endif
+
+#ifdef CONFIG_CACHE
+// 目前使用的是 EEPROM 裡的 config，還沒收到 server 的 config
+bool config_from_cache = false;
+// 最新記錄所在的 slot 和它的 seq
+uint8_t config_cache_slot = CONFIG_CACHE_NONE;
+uint16_t config_cache_seq = 0;
+#endif
+
+#ifdef CLOCK_SYNC
+// 收到 ESP8266_TIME 時的 Unix epoch（ms 的部分直接扣在 epoch_base_ms 上），0 代表還沒收到
+uint32_t epoch_base_s = 0;
+unsigned long epoch_base_ms = 0;
+#endif
+
+#ifdef LOW_POWER_MODE
+bool esp8266_awake = false;
+bool esp8266_waking = true;
+unsigned long esp8266_wake_ms = 0;
+#endif
+
+uint8_t esp8266_tx_control_buffer[ESP8266_TX_CONTROL_SIZE];
+uint8_t esp8266_tx_telemetry_buffer[ESP8266_TX_TELEMETRY_SIZE];
+TxQueue esp8266_tx_queues[TX_QUEUE_COUNT] = {
+    {esp8266_tx_control_buffer, ESP8266_TX_CONTROL_SIZE},
+    {esp8266_tx_telemetry_buffer, ESP8266_TX_TELEMETRY_SIZE},
+};
+// 正在送出的封包所在的佇列和還沒送出的 byte 數
+TxQueue *esp8266_tx_current = NULL;
+uint8_t esp8266_tx_remaining = 0;
+
+#ifdef MULTIDROP_BUS
+uint8_t node_address = 1;
+uint8_t bus_rx_state = BUS_RX_ADDRESS;
+uint16_t bus_rx_remaining = 0;
+bool bus_rx_accept = false;
+// 最後讀到 byte 的時間
+unsigned long bus_rx_last_ms = 0;
+#ifdef PROFILE_LOOP
+// profile 太大放不進佇列，等到被 poll 時才送出
+bool profile_pending = false;
+#endif
+#endif
+
+// 開機以來觀察到的最小剩餘 RAM（stack 和 heap 之間的空間）
+uint16_t min_free_ram = UINT16_MAX;
+
+#ifdef PROFILE_LOOP
+// 每個階段一個 log2 分桶的直方圖，bucket i 約為 [2^i, 2^(i+1)) 個 tick
+uint16_t profile_histograms[PROFILE_STAGE_COUNT][PROFILE_BUCKET_COUNT];
+#endif
+
+extern uint8_t _end;
+extern uint8_t __stack;
+extern uint8_t __heap_start;
+extern void *__brkval;
+
 SoftwareSerial ESP8266Serial(M01_RX_PIN, M01_TX_PIN);
 
 void reset_packet(Packet *packet);
 bool push_packet_payload(Packet *packet, uint8_t data);
 uint8_t get_M();
+void submit_M(uint8_t M);
+#ifdef CONFIG_CACHE
+uint16_t config_record_crc(ConfigRecord *record);
+bool config_cache_load();
+void config_cache_save(uint8_t *config);
+#endif
+#ifdef CLOCK_SYNC
+uint32_t get_epoch_s();
+#endif
+void esp8266_send(uint8_t header, uint8_t *payload, size_t payload_size);
+uint8_t esp8266_tx_priority(uint8_t header);
+void tx_queue_push(TxQueue *queue, uint8_t data);
+uint8_t tx_queue_pop(TxQueue *queue);
+bool esp8266_can_send();
+bool esp8266_tx_pending();
+bool esp8266_tx_pump(uint8_t max_bytes);
+uint8_t esp8266_tx_next_size();
+void esp8266_send_queue_stats();
+#ifdef LOW_POWER_MODE
+void esp8266_wake();
+#endif
+#ifdef MULTIDROP_BUS
+bool bus_accept(uint8_t incoming);
+bool bus_rx_stalled();
+void bus_poll_reply();
+#endif
+void paint_stack() __attribute__((naked, used, section(".init1")));
+uint32_t get_detect_interval();
+bool should_stop_watering(uint8_t M, unsigned long current_ms);
+#ifdef PREDICTIVE_WATERING
+bool is_pump_stop_due(unsigned long current_ms);
+void pump_model_finish(uint8_t M, unsigned long current_ms);
+#endif
+#ifdef PROBE_CHECK
+void probe_check(int V_raw, uint8_t M, unsigned long current_ms);
+void probe_alert();
+#endif
+uint16_t get_free_ram();
+uint16_t get_stack_unused();
+#ifdef PROFILE_LOOP
+void profile_record(uint8_t stage, uint16_t ticks);
+void profile_send();
+#endif
 
 void reset_packet(Packet *packet)
 {
@@ -80,9 +335,599 @@ uint8_t get_M()
 
   uint8_t M = (1 - max(V_raw - (int)V_offset, 0) / float(1023 - V_offset)) * 100;
 
+#ifdef PROBE_CHECK
+  probe_check(V_raw, M, millis());
+#endif
+
   return M;
 }
 
+void submit_M(uint8_t M)
+{
+#ifdef CLOCK_SYNC
+  if (epoch_base_s)
+  {
+    // 暫存或排隊送出的 M 也能在 server 上放回正確的時間
+    uint8_t payload[PACKET_M_AT_PAYLOAD_SIZE];
+    uint32_t epoch_s = get_epoch_s();
+    payload[0] = M;
+    memcpy(payload + 1, &epoch_s, 4);
+    esp8266_send(HEADER_SUBMIT_M_AT, payload, sizeof(payload));
+    return;
+  }
+#endif
+
+  esp8266_send(HEADER_SUBMIT_M, &M, 1);
+}
+
+#ifdef CLOCK_SYNC
+uint32_t get_epoch_s()
+{
+  return epoch_base_s + (millis() - epoch_base_ms) / 1000;
+}
+#endif
+
+#ifdef CONFIG_CACHE
+uint16_t config_record_crc(ConfigRecord *record)
+{
+  uint16_t crc = 0xFFFF;
+  uint8_t *data = (uint8_t *)record;
+
+  for (size_t i = 0; i < offsetof(ConfigRecord, crc); i++)
+  {
+    crc = _crc_ccitt_update(crc, data[i]);
+  }
+
+  return crc;
+}
+
+// 找出最新的記錄並套用，找不到時回傳 false
+bool config_cache_load()
+{
+  ConfigRecord record;
+  uint8_t config[PACKET_CONFIG_PAYLOAD_SIZE];
+
+  for (uint8_t slot = 0; slot < CONFIG_CACHE_SLOT_COUNT; slot++)
+  {
+    EEPROM.get(slot * sizeof(ConfigRecord), record);
+    if (record.crc != config_record_crc(&record))
+    {
+      continue;
+    }
+    // seq 會繞回，用差值比較新舊
+    if (config_cache_slot == CONFIG_CACHE_NONE || (int16_t)(record.seq - config_cache_seq) > 0)
+    {
+      config_cache_slot = slot;
+      config_cache_seq = record.seq;
+      memcpy(config, record.config, sizeof(config));
+    }
+  }
+
+  if (config_cache_slot == CONFIG_CACHE_NONE)
+  {
+    return false;
+  }
+
+  memcpy(&V_offset, config, 4);
+  memcpy(&L, config + 4, 4);
+  memcpy(&U, config + 8, 4);
+  memcpy(&I, config + 12, 4);
+
+  return true;
+}
+
+void config_cache_save(uint8_t *config)
+{
+  ConfigRecord record;
+
+  // server 每次都送一樣的 config，沒有改變就不寫
+  if (config_cache_slot != CONFIG_CACHE_NONE)
+  {
+    EEPROM.get(config_cache_slot * sizeof(ConfigRecord), record);
+    if (memcmp(record.config, config, PACKET_CONFIG_PAYLOAD_SIZE) == 0)
+    {
+      return;
+    }
+  }
+
+  config_cache_slot = config_cache_slot == CONFIG_CACHE_NONE ? 0 : (config_cache_slot + 1) % CONFIG_CACHE_SLOT_COUNT;
+  config_cache_seq++;
+  record.seq = config_cache_seq;
+  memcpy(record.config, config, PACKET_CONFIG_PAYLOAD_SIZE);
+  record.crc = config_record_crc(&record);
+  // 每個 byte 約 3.3 ms，只在 config 改變時寫一次
+  EEPROM.put(config_cache_slot * sizeof(ConfigRecord), record);
+}
+#endif
+
+void esp8266_send(uint8_t header, uint8_t *payload, size_t payload_size)
+{
+  TxQueue *queue = &esp8266_tx_queues[esp8266_tx_priority(header)];
+#ifdef MULTIDROP_BUS
+  uint8_t frame_size = payload_size + 4;
+#else
+  uint8_t frame_size = payload_size + 2;
+#endif
+  uint16_t enqueued_ms = millis();
+
+  // 控制封包盡量不丟，先送出一些資料騰出空間
+  if (queue == &esp8266_tx_queues[TX_QUEUE_CONTROL] && esp8266_can_send())
+  {
+    while (queue->size - queue->length < frame_size + TX_FRAME_HEADER_SIZE && esp8266_tx_pump(ESP8266_TX_BYTES_PER_LOOP))
+      ;
+  }
+
+  if (queue->size - queue->length < frame_size + TX_FRAME_HEADER_SIZE)
+  {
+    queue->dropped++;
+    Serial.println("ESP8266 tx queue full");
+    return;
+  }
+
+  tx_queue_push(queue, frame_size);
+  tx_queue_push(queue, enqueued_ms & 0xFF);
+  tx_queue_push(queue, enqueued_ms >> 8);
+#ifdef MULTIDROP_BUS
+  tx_queue_push(queue, node_address);
+  tx_queue_push(queue, (uint8_t)payload_size);
+#endif
+  tx_queue_push(queue, header);
+  for (size_t i = 0; i < payload_size; i++)
+  {
+    tx_queue_push(queue, payload[i]);
+  }
+  tx_queue_push(queue, EOP);
+  if (queue->length > queue->max_depth)
+  {
+    queue->max_depth = queue->length;
+  }
+
+#ifdef LOW_POWER_MODE
+  if (!esp8266_awake && !esp8266_waking)
+  {
+    esp8266_wake();
+  }
+#endif
+}
+
+uint8_t esp8266_tx_priority(uint8_t header)
+{
+  switch (header)
+  {
+  case HEADER_CLIENT_SUBMIT_CONFIG:
+  case HEADER_CLIENT_GET_SERVER_CONFIG:
+  case HEADER_CLIENT_SUBMIT_PROBE_ALERT:
+    return TX_QUEUE_CONTROL;
+  default:
+    return TX_QUEUE_TELEMETRY;
+  }
+}
+
+void tx_queue_push(TxQueue *queue, uint8_t data)
+{
+  queue->buffer[(queue->head + queue->length) % queue->size] = data;
+  queue->length++;
+}
+
+uint8_t tx_queue_pop(TxQueue *queue)
+{
+  uint8_t data = queue->buffer[queue->head];
+
+  queue->head = (queue->head + 1) % queue->size;
+  queue->length--;
+
+  return data;
+}
+
+bool esp8266_can_send()
+{
+#ifdef LOW_POWER_MODE
+  return esp8266_awake;
+#elif defined(MULTIDROP_BUS)
+  // 只在 bus_poll_reply() 裡送出
+  return false;
+#else
+  return true;
+#endif
+}
+
+bool esp8266_tx_pending()
+{
+  for (auto &queue : esp8266_tx_queues)
+  {
+    if (queue.length)
+    {
+      return true;
+    }
+  }
+
+  return esp8266_tx_remaining > 0;
+}
+
+// 送出最多 max_bytes，有送出資料時回傳 true
+bool esp8266_tx_pump(uint8_t max_bytes)
+{
+  uint8_t sent = 0;
+
+  while (sent < max_bytes)
+  {
+    if (esp8266_tx_remaining == 0)
+    {
+      // 上一個封包送完了，從優先順序最高的佇列取下一個
+      esp8266_tx_current = NULL;
+      for (auto &queue : esp8266_tx_queues)
+      {
+        if (queue.length)
+        {
+          esp8266_tx_current = &queue;
+          break;
+        }
+      }
+      if (!esp8266_tx_current)
+      {
+        break;
+      }
+
+      esp8266_tx_remaining = tx_queue_pop(esp8266_tx_current);
+      uint16_t enqueued_ms = tx_queue_pop(esp8266_tx_current);
+      enqueued_ms |= tx_queue_pop(esp8266_tx_current) << 8;
+      uint16_t wait_ms = (uint16_t)millis() - enqueued_ms;
+      if (wait_ms > esp8266_tx_current->max_wait_ms)
+      {
+        esp8266_tx_current->max_wait_ms = wait_ms;
+      }
+    }
+
+    ESP8266Serial.write(tx_queue_pop(esp8266_tx_current));
+    esp8266_tx_remaining--;
+    sent++;
+  }
+
+  return sent > 0;
+}
+
+// 下一個要送出的封包大小，沒有封包時回傳 0
+uint8_t esp8266_tx_next_size()
+{
+  for (auto &queue : esp8266_tx_queues)
+  {
+    if (queue.length)
+    {
+      return queue.buffer[queue.head];
+    }
+  }
+
+  return 0;
+}
+
+void esp8266_send_queue_stats()
+{
+  uint8_t payload[PACKET_QUEUE_STATS_PAYLOAD_SIZE];
+  uint8_t *p = payload;
+
+  for (auto &queue : esp8266_tx_queues)
+  {
+    uint16_t max_depth = queue.max_depth;
+    memcpy(p, &max_depth, 2);
+    memcpy(p + 2, &queue.max_wait_ms, 2);
+    memcpy(p + 4, &queue.dropped, 2);
+    p += 6;
+    queue.max_depth = queue.length;
+    queue.max_wait_ms = 0;
+    queue.dropped = 0;
+  }
+  esp8266_send(HEADER_CLIENT_SUBMIT_QUEUE_STATS, payload, sizeof(payload));
+}
+
+#ifdef LOW_POWER_MODE
+void esp8266_wake()
+{
+  Serial.println("waking ESP8266");
+  digitalWrite(ESP8266_EN_PIN, LOW);
+  delay(ESP8266_WAKE_PULSE_MS);
+  digitalWrite(ESP8266_EN_PIN, HIGH);
+  esp8266_waking = true;
+  esp8266_wake_ms = millis();
+}
+#endif
+
+#ifdef MULTIDROP_BUS
+// 拆掉 [節點位址][payload 長度]，只把給這個節點或廣播的 byte 交給封包解析
+bool bus_accept(uint8_t incoming)
+{
+  bus_rx_last_ms = millis();
+
+  switch (bus_rx_state)
+  {
+  case BUS_RX_ADDRESS:
+    bus_rx_accept = incoming == node_address || incoming == BUS_BROADCAST;
+    bus_rx_state = BUS_RX_LENGTH;
+    return false;
+
+  case BUS_RX_LENGTH:
+    // header + payload + EOP
+    bus_rx_remaining = incoming + 2;
+    bus_rx_state = BUS_RX_FRAME;
+    return false;
+
+  default:
+    if (--bus_rx_remaining == 0)
+    {
+      bus_rx_state = BUS_RX_ADDRESS;
+    }
+    return bus_rx_accept;
+  }
+}
+
+// 在 ESP8266Serial 沒有資料時呼叫：緩衝區已經讀完，所以從 bus_rx_last_ms 到現在都沒有新的 byte。
+// 停在 frame 中間太久時重新對齊，回傳 true 代表收到一半的封包要丟掉
+bool bus_rx_stalled()
+{
+  if (bus_rx_state == BUS_RX_ADDRESS || millis() - bus_rx_last_ms < BUS_RX_IDLE_RESET_MS)
+  {
+    return false;
+  }
+
+  bus_rx_state = BUS_RX_ADDRESS;
+  return true;
+}
+
+// 輪到這個節點，送出暫存的封包之後交還 bus
+void bus_poll_reply()
+{
+  uint8_t budget = BUS_POLL_REPLY_MAX_BYTES;
+  uint8_t frame_size;
+
+  digitalWrite(RS485_DE_PIN, HIGH);
+#ifdef PROFILE_LOOP
+  // profile 比佇列的上限還大，單獨用一次 poll 送出
+  if (profile_pending)
+  {
+    profile_pending = false;
+    profile_send();
+    budget = 0;
+  }
+#endif
+  // 只送出完整的封包，bus 上不能有送到一半的封包
+  while ((frame_size = esp8266_tx_next_size()) && frame_size <= budget)
+  {
+    esp8266_tx_pump(frame_size);
+    budget -= frame_size;
+  }
+  ESP8266Serial.write(node_address);
+  ESP8266Serial.write((uint8_t)0);
+  ESP8266Serial.write(HEADER_BUS_POLL_END);
+  ESP8266Serial.write(EOP);
+  // SoftwareSerial 的 write 送完才會回傳，可以直接放開 bus
+  digitalWrite(RS485_DE_PIN, LOW);
+}
+#endif
+
+uint32_t get_detect_interval()
+{
+  if (!is_watering)
+  {
+    return DETECT_INTERVAL_IDLE_MS;
+  }
+
+#ifdef PREDICTIVE_WATERING
+  // 已經排定停止時間，只需要低頻率確認
+  if (pump_model.stop_scheduled)
+  {
+    return DETECT_INTERVAL_VERIFY_MS;
+  }
+#endif
+
+  return DETECT_INTERVAL_BUSY_MS;
+}
+
+bool should_stop_watering(uint8_t M, unsigned long current_ms)
+{
+#ifdef PROBE_CHECK
+  if (probe_status != PROBE_OK)
+  {
+    return true;
+  }
+#endif
+
+#ifdef PREDICTIVE_WATERING
+  if (pump_model.rate > 0)
+  {
+    // 停止後 M 還會再上升，提前停止避免超過 U
+    return pump_model_should_stop(&pump_model, M, U, current_ms);
+  }
+#endif
+
+  return M >= U;
+}
+
+#ifdef PREDICTIVE_WATERING
+bool is_pump_stop_due(unsigned long current_ms)
+{
+  return is_watering && pump_model_stop_due(&pump_model, current_ms);
+}
+
+void pump_model_finish(uint8_t M, unsigned long current_ms)
+{
+#ifdef PROBE_CHECK
+  // 感測器異常時的量測不可信
+  if (probe_status != PROBE_OK)
+  {
+    pump_model.stop_scheduled = false;
+    pump_model.stop_ms = current_ms;
+    return;
+  }
+#endif
+
+  if (!pump_model_stop(&pump_model, M, current_ms))
+  {
+    return;
+  }
+
+  // 回報模型到 server，速率以每秒千分之一 M 為單位
+  uint32_t rate_milli = pump_model.rate * 1000;
+  Serial.print("pump model: rate_milli=");
+  Serial.print(rate_milli);
+  Serial.print(", dead_time_ms=");
+  Serial.println(pump_model.dead_time_ms);
+  uint8_t payload[PACKET_PUMP_MODEL_PAYLOAD_SIZE];
+  memcpy(payload, &rate_milli, 4);
+  memcpy(payload + 4, &pump_model.dead_time_ms, 4);
+  esp8266_send(HEADER_CLIENT_SUBMIT_PUMP_MODEL, payload, sizeof(payload));
+}
+#endif
+
+#ifdef PROBE_CHECK
+void probe_check(int V_raw, uint8_t M, unsigned long current_ms)
+{
+  uint8_t status = PROBE_OK;
+
+  if (V_raw == probe_last_raw)
+  {
+    if (probe_flat_count < UINT16_MAX)
+    {
+      probe_flat_count++;
+    }
+  }
+  else
+  {
+    probe_flat_count = 0;
+  }
+
+  if (V_raw <= PROBE_RAW_MIN || V_raw >= PROBE_RAW_MAX)
+  {
+    status = PROBE_SATURATED;
+  }
+  else if (probe_flat_count >= PROBE_FLATLINE_COUNT)
+  {
+    status = PROBE_FLATLINE;
+  }
+  else if (probe_last_M != UINT8_MAX && abs((int)M - (int)probe_last_M) > PROBE_MAX_STEP)
+  {
+    status = PROBE_SLOPE;
+  }
+  else if (is_watering && current_ms - probe_pump_start_ms >= PROBE_NO_RESPONSE_MS &&
+           M < probe_pump_start_M + PUMP_RISE_THRESHOLD)
+  {
+    status = PROBE_NO_RESPONSE;
+  }
+
+  probe_last_raw = V_raw;
+  probe_last_M = M;
+
+  if (status != PROBE_OK)
+  {
+    probe_normal_count = 0;
+    // 沒有反應的異常優先保留，只回報狀態的變化
+    if (status != probe_status && probe_status != PROBE_NO_RESPONSE)
+    {
+      probe_status = status;
+      probe_alert();
+    }
+    return;
+  }
+
+  // 沒有反應的異常要等 server 重新設定 config 才解除
+  if (probe_status == PROBE_OK || probe_status == PROBE_NO_RESPONSE)
+  {
+    return;
+  }
+
+  if (++probe_normal_count >= PROBE_RECOVER_COUNT)
+  {
+    probe_status = PROBE_OK;
+    probe_alert();
+  }
+}
+
+void probe_alert()
+{
+  uint8_t payload[PACKET_PROBE_ALERT_PAYLOAD_SIZE];
+  uint16_t V_raw = probe_last_raw;
+
+  Serial.print("probe status=");
+  Serial.print(probe_status);
+  Serial.print(", V_raw=");
+  Serial.print(V_raw);
+  Serial.print(", M=");
+  Serial.println(probe_last_M);
+  payload[0] = probe_status;
+  memcpy(payload + 1, &V_raw, 2);
+  payload[3] = probe_last_M;
+  esp8266_send(HEADER_CLIENT_SUBMIT_PROBE_ALERT, payload, sizeof(payload));
+}
+#endif
+
+// 在 main() 之前把 heap 到 stack 頂端之間填滿 STACK_CANARY
+void paint_stack()
+{
+  uint8_t *p = &_end;
+
+  while (p <= &__stack)
+  {
+    *p++ = STACK_CANARY;
+  }
+}
+
+uint16_t get_free_ram()
+{
+  uint8_t *heap_end = __brkval ? (uint8_t *)__brkval : &__heap_start;
+
+  return (uint16_t)((uint8_t *)SP - heap_end);
+}
+
+// 從 heap 頂端往上數，還沒被 stack 或 heap 碰過的 byte 數
+uint16_t get_stack_unused()
+{
+  uint8_t *p = __brkval ? (uint8_t *)__brkval : &__heap_start;
+  uint16_t unused = 0;
+
+  while (p <= &__stack && *p == STACK_CANARY)
+  {
+    p++;
+    unused++;
+  }
+
+  return unused;
+}
+
+#ifdef PROFILE_LOOP
+void profile_record(uint8_t stage, uint16_t ticks)
+{
+  uint8_t bucket = 0;
+
+  ticks >>= PROFILE_BUCKET_SHIFT;
+  while (ticks > 1 && bucket < PROFILE_BUCKET_COUNT - 1)
+  {
+    ticks >>= 1;
+    bucket++;
+  }
+
+  if (profile_histograms[stage][bucket] < UINT16_MAX)
+  {
+    profile_histograms[stage][bucket]++;
+  }
+}
+
+void profile_send()
+{
+  // 不能插在其他封包中間，先送完送到一半的封包
+  esp8266_tx_pump(esp8266_tx_remaining);
+#ifdef MULTIDROP_BUS
+  ESP8266Serial.write(node_address);
+  ESP8266Serial.write((uint8_t)(PACKET_PROFILE_PAYLOAD_SIZE));
+#endif
+  ESP8266Serial.write(HEADER_CLIENT_SUBMIT_PROFILE);
+  ESP8266Serial.write((uint8_t)PROFILE_STAGE_COUNT);
+  ESP8266Serial.write((uint8_t)PROFILE_BUCKET_COUNT);
+  ESP8266Serial.write((uint8_t)PROFILE_BUCKET_SHIFT);
+  ESP8266Serial.write((uint8_t)sizeof(profile_histograms[0][0]));
+  ESP8266Serial.write((uint8_t)PROFILE_TICKS_PER_US);
+  ESP8266Serial.write((uint8_t *)profile_histograms, sizeof(profile_histograms));
+  ESP8266Serial.write(EOP);
+}
+#endif
+
 void setup()
 {
   Serial.begin(115200);
@@ -101,21 +946,69 @@ void setup()
   digitalWrite(ESP8266_EN_PIN, LOW);
   delay(100);
   digitalWrite(ESP8266_EN_PIN, HIGH);
+
+#ifdef MULTIDROP_BUS
+  pinMode(RS485_DE_PIN, OUTPUT);
+  digitalWrite(RS485_DE_PIN, LOW);
+  pinMode(NODE_ADDRESS_PIN_0, INPUT_PULLUP);
+  pinMode(NODE_ADDRESS_PIN_1, INPUT_PULLUP);
+  node_address = 1 + (digitalRead(NODE_ADDRESS_PIN_1) == LOW) * 2 + (digitalRead(NODE_ADDRESS_PIN_0) == LOW);
+  Serial.print("bus node address: ");
+  Serial.println(node_address);
+#endif
+
+#ifdef PROFILE_LOOP
+  // Timer1 自由計數，除頻 8
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);
+#endif
+
+#ifdef CONFIG_CACHE
+  if (config_cache_load())
+  {
+    config_inited = true;
+    config_from_cache = true;
+    Serial.print("config loaded from EEPROM: ");
+    Serial.print("V_offset=");
+    Serial.print(V_offset);
+    Serial.print(", L=");
+    Serial.print(L);
+    Serial.print(", U=");
+    Serial.print(U);
+    Serial.print(", I=");
+    Serial.println(I);
+  }
+#endif
 }
 
 void loop()
 {
   static unsigned long last_task1_ms = 0;
   static unsigned long last_task2_ms = 0;
+  static unsigned long last_task3_ms = 0;
+#ifdef CONFIG_CACHE
+  static unsigned long last_config_request_ms = 0;
+  static unsigned long config_request_interval_ms = CONFIG_REQUEST_RETRY_MS;
+#endif
   static unsigned long current_ms = 0;
 
   static Packet packet;
   static uint8_t incoming = 0;
   static uint8_t M = UINT8_MAX;
 
+  static uint16_t free_ram = 0;
+
+  PROFILE_BEGIN(PROFILE_STAGE_LOOP);
+
   M = UINT8_MAX;
   current_ms = millis();
 
+  free_ram = get_free_ram();
+  if (free_ram < min_free_ram)
+  {
+    min_free_ram = free_ram;
+  }
+
   // config 初始化之後才開始做定時任務和澆水
   if (config_inited)
   {
@@ -125,39 +1018,81 @@ void loop()
       last_task1_ms = current_ms;
       if (M == UINT8_MAX)
       {
+        PROFILE_BEGIN(PROFILE_STAGE_GET_M);
         M = get_M();
+        PROFILE_END(PROFILE_STAGE_GET_M);
         Serial.print("M=");
         Serial.println(M);
       }
-      ESP8266Serial.write(HEADER_SUBMIT_M);
-      ESP8266Serial.write(M);
-      ESP8266Serial.write(EOP);
+      submit_M(M);
     }
 
     // 檢查是否要澆水
     // 檢查是否要澆水的頻率
-    if (current_ms - last_task2_ms > (is_watering ? DETECT_INTERVAL_BUSY_MS : DETECT_INTERVAL_IDLE_MS))
+    if (current_ms - last_task2_ms > get_detect_interval()
+#ifdef PREDICTIVE_WATERING
+        || is_pump_stop_due(current_ms)
+#endif
+    )
     {
       last_task2_ms = current_ms;
       if (M == UINT8_MAX)
       {
+        PROFILE_BEGIN(PROFILE_STAGE_GET_M);
         M = get_M();
+        PROFILE_END(PROFILE_STAGE_GET_M);
       }
 
-      if (!is_watering && M < L)
+#ifdef PREDICTIVE_WATERING
+      if (is_watering)
+      {
+        pump_model_sample(&pump_model, M, current_ms);
+      }
+#endif
+
+      if (!is_watering && M < L
+#ifdef PROBE_CHECK
+          && probe_status == PROBE_OK
+#endif
+#ifdef PREDICTIVE_WATERING
+          && pump_model_can_start(&pump_model, current_ms)
+#endif
+      )
       {
         // 開始澆水
         digitalWrite(WATER_PUMP_PIN, HIGH);
         is_watering = true;
         Serial.println("start watering");
+#ifdef LOW_POWER_MODE
+        // 澆水事件也回報 server
+        submit_M(M);
+#endif
+#ifdef PREDICTIVE_WATERING
+        pump_model_start(&pump_model, M, U, current_ms);
+        if (pump_model.stop_scheduled)
+        {
+          Serial.print("scheduled stop in ms: ");
+          Serial.println(pump_model.on_ms);
+        }
+#endif
+#ifdef PROBE_CHECK
+        probe_pump_start_ms = current_ms;
+        probe_pump_start_M = M;
+#endif
       }
 
-      if (is_watering && M >= U)
+      if (is_watering && should_stop_watering(M, current_ms))
       {
         // 停止澆水
         digitalWrite(WATER_PUMP_PIN, LOW);
         is_watering = false;
         Serial.println("stop watering");
+#ifdef LOW_POWER_MODE
+        submit_M(M);
+#endif
+#ifdef PREDICTIVE_WATERING
+        pump_model_finish(M, current_ms);
+#endif
       }
     }
   }
@@ -167,15 +1102,63 @@ void loop()
     {
       last_task2_ms = current_ms;
       Serial.println("waiting for server initialization...");
-      ESP8266Serial.write(HEADER_CLIENT_GET_SERVER_CONFIG);
-      ESP8266Serial.write(EOP);
+      esp8266_send(HEADER_CLIENT_GET_SERVER_CONFIG, NULL, 0);
     }
   }
 
+#ifdef CONFIG_CACHE
+  // 用 EEPROM 裡的 config 運作時，以指數退避向 server 要最新的 config，收到後就停止
+  if (config_from_cache && current_ms - last_config_request_ms > config_request_interval_ms)
+  {
+    last_config_request_ms = current_ms;
+    config_request_interval_ms = min(config_request_interval_ms * 2, CONFIG_REQUEST_MAX_RETRY_MS);
+    esp8266_send(HEADER_CLIENT_GET_SERVER_CONFIG, NULL, 0);
+  }
+#endif
+
+#ifdef LOW_POWER_MODE
+  // 喚醒之後一直沒收到 AWAKE，再喚醒一次
+  if (!esp8266_awake && esp8266_waking && esp8266_tx_pending() && current_ms - esp8266_wake_ms > ESP8266_WAKE_TIMEOUT_MS)
+  {
+    esp8266_wake();
+  }
+#endif
+
+  // 回報記憶體狀況到 server
+  if (current_ms - last_task3_ms > HEALTH_REPORT_INTERVAL_MS)
+  {
+    last_task3_ms = current_ms;
+    uint16_t stack_unused = get_stack_unused();
+    uint8_t payload[4];
+    Serial.print("min_free_ram=");
+    Serial.print(min_free_ram);
+    Serial.print(", stack_unused=");
+    Serial.println(stack_unused);
+    memcpy(payload, &min_free_ram, 2);
+    memcpy(payload + 2, &stack_unused, 2);
+    esp8266_send(HEADER_CLIENT_SUBMIT_HEALTH, payload, sizeof(payload));
+    esp8266_send_queue_stats();
+  }
+
+  if (esp8266_can_send())
+  {
+    PROFILE_BEGIN(PROFILE_STAGE_SERIAL_WRITE);
+    esp8266_tx_pump(ESP8266_TX_BYTES_PER_LOOP);
+    PROFILE_END(PROFILE_STAGE_SERIAL_WRITE);
+  }
+
   if (ESP8266Serial.available())
   {
+    PROFILE_BEGIN(PROFILE_STAGE_PARSE);
     incoming = ESP8266Serial.read();
 
+#ifdef MULTIDROP_BUS
+    if (!bus_accept(incoming))
+    {
+      // 位址、長度，或是給其他節點的 byte
+    }
+    else
+#endif
     if (packet.header == HEADER_EMPTY)
     {
       packet.header = incoming;
@@ -209,22 +1192,96 @@ void loop()
             Serial.print(", I=");
             Serial.println(I);
           }
+#ifdef CONFIG_CACHE
+          config_from_cache = false;
+          config_cache_save(packet.payload);
+#endif
+#ifdef PROBE_CHECK
+          // 重新設定 config 時解除沒有反應的異常
+          if (probe_status == PROBE_NO_RESPONSE)
+          {
+            probe_status = PROBE_OK;
+            probe_alert();
+          }
+#endif
         }
         reset_packet(&packet);
         break;
 
+#ifdef CLOCK_SYNC
+      case HEADER_ESP8266_TIME:
+        if (packet.payload_size < PACKET_TIME_PAYLOAD_SIZE)
+        {
+          push_packet_payload(&packet, incoming);
+          break;
+        }
+        if (incoming == EOP)
+        {
+          uint16_t epoch_frac_ms;
+          memcpy(&epoch_base_s, packet.payload, 4);
+          memcpy(&epoch_frac_ms, packet.payload + 4, 2);
+          epoch_base_ms = millis() - epoch_frac_ms;
+        }
+        reset_packet(&packet);
+        break;
+#endif
+
       case HEADER_SERVER_GET_CLIENT_CONFIG:
         if (incoming == EOP)
         {
-          ESP8266Serial.write(HEADER_CLIENT_SUBMIT_CONFIG);
-          ESP8266Serial.write((uint8_t *)&V_offset, (size_t)4);
-          ESP8266Serial.write((uint8_t *)&L, (size_t)4);
-          ESP8266Serial.write((uint8_t *)&U, (size_t)4);
-          ESP8266Serial.write((uint8_t *)&I, (size_t)4);
-          ESP8266Serial.write(EOP);
+          uint8_t payload[PACKET_CONFIG_PAYLOAD_SIZE];
+          memcpy(payload, &V_offset, 4);
+          memcpy(payload + 4, &L, 4);
+          memcpy(payload + 8, &U, 4);
+          memcpy(payload + 12, &I, 4);
+          esp8266_send(HEADER_CLIENT_SUBMIT_CONFIG, payload, sizeof(payload));
+        }
+        reset_packet(&packet);
+        break;
+
+#ifdef PROFILE_LOOP
+      case HEADER_SERVER_DEBUG_GET_PROFILE:
+        if (incoming == EOP)
+        {
+#ifdef MULTIDROP_BUS
+          profile_pending = true;
+#else
+          profile_send();
+#endif
         }
         reset_packet(&packet);
         break;
+#endif
+
+#ifdef LOW_POWER_MODE
+      case HEADER_ESP8266_AWAKE:
+        if (incoming == EOP)
+        {
+          esp8266_awake = true;
+          esp8266_waking = false;
+        }
+        reset_packet(&packet);
+        break;
+
+      case HEADER_ESP8266_SLEEP:
+        if (incoming == EOP)
+        {
+          esp8266_awake = false;
+          esp8266_waking = false;
+        }
+        reset_packet(&packet);
+        break;
+#endif
+
+#ifdef MULTIDROP_BUS
+      case HEADER_BUS_POLL:
+        if (incoming == EOP)
+        {
+          bus_poll_reply();
+        }
+        reset_packet(&packet);
+        break;
+#endif
 
       case HEADER_ESP8266_LOG_MESSAGE:
         if (incoming == EOP)
@@ -242,7 +1299,17 @@ void loop()
         break;
       }
     }
+    PROFILE_END(PROFILE_STAGE_PARSE);
   }
+#ifdef MULTIDROP_BUS
+  else if (bus_rx_stalled())
+  {
+    Serial.println("bus frame dropped");
+    reset_packet(&packet);
+  }
+#endif
+
+  PROFILE_END(PROFILE_STAGE_LOOP);
 
   // 降低功耗
   delay(1);
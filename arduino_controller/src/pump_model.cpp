@@ -0,0 +1,84 @@
+#include "pump_model.h"
+
+void pump_model_start(PumpModel *model, uint8_t M, uint32_t U, unsigned long current_ms)
+{
+  model->start_ms = current_ms;
+  model->start_M = M;
+  model->risen = false;
+  model->stop_scheduled = false;
+
+  if (model->rate > 0)
+  {
+    // M 在死區時間之後以 rate 上升，停止後也會延遲一個死區時間才停止上升，
+    // 所以總共只需要澆 (U - M) / rate 秒
+    float on_ms = ((float)U - M) / model->rate * 1000;
+    model->on_ms = on_ms < PUMP_MAX_ON_MS ? (unsigned long)on_ms : PUMP_MAX_ON_MS;
+    model->stop_scheduled = true;
+  }
+}
+
+void pump_model_sample(PumpModel *model, uint8_t M, unsigned long current_ms)
+{
+  if (!model->risen && M >= model->start_M + PUMP_RISE_THRESHOLD)
+  {
+    model->risen = true;
+    model->rise_ms = current_ms;
+    model->rise_M = M;
+  }
+}
+
+bool pump_model_should_stop(PumpModel *model, uint8_t M, uint32_t U, unsigned long current_ms)
+{
+  // 停止後 M 還會再上升，上升量是還在路上的水：澆水時間未滿一個死區時間時只有已經澆出的部分
+  unsigned long in_flight_ms = current_ms - model->start_ms;
+  if (in_flight_ms > model->dead_time_ms)
+  {
+    in_flight_ms = model->dead_time_ms;
+  }
+
+  return M + model->rate * in_flight_ms / 1000 >= U || pump_model_stop_due(model, current_ms);
+}
+
+bool pump_model_stop_due(PumpModel *model, unsigned long current_ms)
+{
+  return model->stop_scheduled && current_ms - model->start_ms >= model->on_ms;
+}
+
+bool pump_model_can_start(PumpModel *model, unsigned long current_ms)
+{
+  return current_ms - model->stop_ms >= model->dead_time_ms;
+}
+
+bool pump_model_stop(PumpModel *model, uint8_t M, unsigned long current_ms)
+{
+  model->stop_scheduled = false;
+  model->stop_ms = current_ms;
+
+  // 土壤沒有反應或量測時間太短，不更新模型
+  if (!model->risen || M <= model->rise_M || current_ms - model->rise_ms < PUMP_MODEL_MIN_SPAN_MS)
+  {
+    return false;
+  }
+
+  float rate = (M - model->rise_M) * 1000.0 / (current_ms - model->rise_ms);
+  // 扣掉 M 從開始上升到超過 PUMP_RISE_THRESHOLD 所花的時間
+  float rise_time_ms = (model->rise_M - model->start_M) * 1000.0 / rate;
+  float dead_time_ms = (float)(model->rise_ms - model->start_ms) - rise_time_ms;
+  if (dead_time_ms < 0)
+  {
+    dead_time_ms = 0;
+  }
+
+  if (model->rate > 0)
+  {
+    model->rate += PUMP_MODEL_ALPHA * (rate - model->rate);
+    model->dead_time_ms += PUMP_MODEL_ALPHA * (dead_time_ms - model->dead_time_ms);
+  }
+  else
+  {
+    model->rate = rate;
+    model->dead_time_ms = dead_time_ms;
+  }
+
+  return true;
+}
@@ -0,0 +1,160 @@
+#include <unity.h>
+#include <vector>
+
+#include "pump_model.h"
+
+// 模擬土壤：水要經過 dead_ms 才到達感測器，之後 M 以 rate 上升，平時以 dry_rate 下降。
+// 控制流程和 main.cpp 的 loop() 相同，以 10 ms 為一步。
+#define STEP_MS 10
+// 和 main.cpp 相同
+#define DETECT_INTERVAL_BUSY_MS 100
+#define DETECT_INTERVAL_IDLE_MS 10000
+#define DETECT_INTERVAL_VERIFY_MS 1000
+
+typedef struct
+{
+  double M;
+  unsigned long dead_ms;
+  double rate;
+  double dry_rate;
+  // 每一步水泵是否開著
+  std::vector<bool> pump_history;
+} Soil;
+
+typedef struct
+{
+  // 每次澆水期間（到下次開始澆水為止）M 的最高值和水泵開啟時間
+  std::vector<double> peaks;
+  std::vector<unsigned long> on_ms;
+  PumpModel model;
+} Result;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+Result simulate(Soil soil, uint8_t L, uint32_t U, int cycles)
+{
+  Result result = {};
+  bool is_watering = false;
+  unsigned long last_check_ms = 0;
+  unsigned long start_ms = 0;
+
+  for (unsigned long t = 0; t < 24UL * 3600 * 1000; t += STEP_MS)
+  {
+    // 土壤
+    size_t step = t / STEP_MS;
+    soil.pump_history.push_back(is_watering);
+    soil.M -= soil.dry_rate * STEP_MS / 1000;
+    if (step >= soil.dead_ms / STEP_MS && soil.pump_history[step - soil.dead_ms / STEP_MS])
+    {
+      soil.M += soil.rate * STEP_MS / 1000;
+    }
+    if (!result.peaks.empty() && soil.M > result.peaks.back())
+    {
+      result.peaks.back() = soil.M;
+    }
+
+    // 控制器
+    uint32_t interval = !is_watering ? DETECT_INTERVAL_IDLE_MS : result.model.stop_scheduled ? DETECT_INTERVAL_VERIFY_MS
+                                                                                            : DETECT_INTERVAL_BUSY_MS;
+    if (t - last_check_ms <= interval && !(is_watering && pump_model_stop_due(&result.model, t)))
+    {
+      continue;
+    }
+    last_check_ms = t;
+    uint8_t M = (uint8_t)soil.M;
+
+    if (is_watering)
+    {
+      pump_model_sample(&result.model, M, t);
+    }
+
+    if (!is_watering && M < L && pump_model_can_start(&result.model, t))
+    {
+      if ((int)result.peaks.size() == cycles)
+      {
+        break;
+      }
+      is_watering = true;
+      start_ms = t;
+      result.peaks.push_back(soil.M);
+      pump_model_start(&result.model, M, U, t);
+    }
+
+    if (is_watering && (result.model.rate > 0 ? pump_model_should_stop(&result.model, M, U, t) : M >= U))
+    {
+      is_watering = false;
+      result.on_ms.push_back(t - start_ms);
+      pump_model_stop(&result.model, M, t);
+    }
+  }
+
+  return result;
+}
+
+void test_lands_on_upper_bound()
+{
+  Soil soil = {35, 5000, 0.5, 0.01};
+  Result result = simulate(soil, 30, 70, 4);
+
+  TEST_ASSERT_EQUAL(4, result.peaks.size());
+  // 還沒有模型時，停止後還會多上升一個死區時間
+  TEST_ASSERT_GREATER_THAN(72, result.peaks[0]);
+  TEST_ASSERT_FLOAT_WITHIN(0.1, 0.5, result.model.rate);
+  // M 是整數，量到的死區時間會偏短一些
+  TEST_ASSERT_FLOAT_WITHIN(2000, 5000, result.model.dead_time_ms);
+  for (size_t i = 1; i < result.peaks.size(); i++)
+  {
+    TEST_ASSERT_FLOAT_WITHIN(1.5, 70, result.peaks[i]);
+  }
+}
+
+void test_dead_time_longer_than_fill_time()
+{
+  // U - L 比死區時間內澆出的水還少，剛開始澆水時不能用整個死區時間的量來判斷
+  Soil soil = {35, 60000, 0.5, 0.01};
+  Result result = simulate(soil, 30, 40, 4);
+
+  TEST_ASSERT_EQUAL(4, result.peaks.size());
+  TEST_ASSERT_GREATER_THAN(0, result.model.rate);
+  for (size_t i = 1; i < result.peaks.size(); i++)
+  {
+    // 每次都有澆水，而且大約停在 U
+    TEST_ASSERT_GREATER_THAN(15000, result.on_ms[i]);
+    TEST_ASSERT_FLOAT_WITHIN(1.5, 40, result.peaks[i]);
+  }
+}
+
+void test_in_flight_water_limited_by_elapsed_time()
+{
+  PumpModel model = {};
+  model.rate = 0.5;
+  model.dead_time_ms = 60000;
+
+  pump_model_start(&model, 30, 40, 1000);
+  TEST_ASSERT_TRUE(model.stop_scheduled);
+  TEST_ASSERT_EQUAL(20000, model.on_ms);
+  // 剛開始澆水，還在路上的水只有 0.1 秒的量
+  TEST_ASSERT_FALSE(pump_model_should_stop(&model, 30, 40, 1100));
+  TEST_ASSERT_FALSE(pump_model_should_stop(&model, 30, 40, 20000));
+  TEST_ASSERT_TRUE(pump_model_should_stop(&model, 30, 40, 21000));
+
+  // M 還沒上升，模型不更新，但水還在路上
+  TEST_ASSERT_FALSE(pump_model_stop(&model, 30, 21000));
+  TEST_ASSERT_FALSE(pump_model_can_start(&model, 60000));
+  TEST_ASSERT_TRUE(pump_model_can_start(&model, 81000));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_lands_on_upper_bound);
+  RUN_TEST(test_dead_time_longer_than_fill_time);
+  RUN_TEST(test_in_flight_water_limited_by_elapsed_time);
+  return UNITY_END();
+}
@@ -0,0 +1,39 @@
+#ifndef STK500_H
+#define STK500_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// STK500v1 燒錄（stk500.cpp），用來透過 optiboot 燒錄 arduino_controller。
+// 和 bootloader 之間的 serial 由 Stk500Port 提供，不依賴 Arduino，可以在 [env:native] 上用假的 optiboot 測試。
+
+// ATmega328P 的 flash page 大小
+#define STK500_PAGE_SIZE 128
+#define STK500_SYNC_RETRY 10
+#define STK500_TIMEOUT_MS 500
+#define STK_OK (uint8_t)0x10
+#define STK_INSYNC (uint8_t)0x14
+#define STK_CRC_EOP (uint8_t)0x20
+#define STK_GET_SYNC (uint8_t)0x30
+#define STK_ENTER_PROGMODE (uint8_t)0x50
+#define STK_LEAVE_PROGMODE (uint8_t)0x51
+#define STK_LOAD_ADDRESS (uint8_t)0x55
+#define STK_PROG_PAGE (uint8_t)0x64
+#define STK_READ_PAGE (uint8_t)0x74
+
+typedef struct
+{
+  int (*available)();
+  int (*read)();
+  size_t (*write)(const uint8_t *data, size_t length);
+  // 最多等 timeout_ms，回傳實際讀到的 byte 數
+  size_t (*read_bytes)(uint8_t *buffer, size_t length, unsigned long timeout_ms);
+} Stk500Port;
+
+// 送出一個命令，收到 INSYNC、response_size bytes 的回應和 OK 時回傳 true
+bool stk500_command(Stk500Port *port, uint8_t *command, size_t command_size, uint8_t *data, size_t data_size, uint8_t *response, size_t response_size);
+// 從 read_image 讀出 image_size bytes 逐頁燒錄並讀回比對，最後離開燒錄模式。
+// 呼叫前 bootloader 要已經在執行
+bool stk500_flash(Stk500Port *port, size_t (*read_image)(uint8_t *buffer, size_t size), uint32_t image_size);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <Arduino.h>
+
+// 與 server 之間的傳輸層，預設為 TCP（transport_tcp.cpp），
+// 編譯時加上 -D TRANSPORT_WS 改用 WebSocket over TLS（transport_ws.cpp）。
+// 兩者都是 byte stream，封包格式與邊界由上層決定。
+
+// 連線並送出認證頭（多行 "Key: Value"，以 \r\n 分隔）
+bool transport_connect(const char *host, uint16_t port, const String &headers);
+void transport_stop();
+// 連線是否還在，server 關閉連線（或 WebSocket 收到 CLOSE）後回傳 false
+bool transport_connected();
+int transport_available();
+size_t transport_read(uint8_t *buffer, size_t size);
+size_t transport_write(const uint8_t *buffer, size_t size);
+// 立即送出所有暫存的資料
+void transport_flush();
+// 每輪 loop() 呼叫一次，處理定時送出等工作
+void transport_loop();
+
+#endif
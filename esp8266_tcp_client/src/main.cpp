@@ -1,70 +1,506 @@
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
 #include <WiFiClient.h>
+#include <Updater.h>
+#include <LittleFS.h>
+#include <MD5Builder.h>
+
+#include "stk500.h"
+#include "transport.h"
 
 #define API_KEY "key-16888888"
 
 #define WIFI_MAX_RETRY_TIME_MS 10000
 
+#ifdef TRANSPORT_WS
+#define TCP_HOST "pi.cch137.link"
+#define TCP_PORT 443
+#else
 #define TCP_HOST "140.115.200.43"
 #define TCP_PORT 9453
+#endif
 #define TCP_PING_INTERVAL_MS 5000
 #define TCP_PONG_TIMEOUT_MS 10000
+#define TCP_HEALTH_INTERVAL_MS 60000
+
+// 有多個 server 時選延遲最低且健康的一個，PONG 逾時或連線失敗就換下一個。
+// 延遲一律用 TCP 連線時間（約一個 RTT）比較，PING 到 PONG 的時間還包含 server 處理和傳輸層的批次，不能混用
+// 還沒量過延遲的 server 以 ENDPOINT_UNKNOWN_LATENCY_MS 計算
+#define ENDPOINT_UNKNOWN_LATENCY_MS 1000
+// 失敗的 server 在退避期間只有全部都失敗時才會被選到
+#define ENDPOINT_UNHEALTHY_PENALTY_MS 60000
+#define ENDPOINT_RETRY_MS 5000
+#define ENDPOINT_MAX_RETRY_MS 300000
+// 定時量測其他 server 和目前 server 的 TCP 連線時間，明顯比較快就切換過去
+#define ENDPOINT_PROBE_INTERVAL_MS 600000
+#define ENDPOINT_PROBE_TIMEOUT_MS 1000
+#define ENDPOINT_SWITCH_MARGIN_MS 20
 
 #define OPCODE_EMPTY (uint8_t)0
 #define OPCODE_PING (uint8_t)101
 #define OPCODE_PONG (uint8_t)102
+#define OPCODE_TIME_PING (uint8_t)103
+#define OPCODE_TIME_PONG (uint8_t)104
 #define OPCODE_SUBMIT_M (uint8_t)110
 #define OPCODE_CLIENT_SUBMIT_CONFIG (uint8_t)111
 #define OPCODE_SERVER_SET_CLIENT_CONFIG (uint8_t)112
 #define OPCODE_SERVER_GET_CLIENT_CONFIG (uint8_t)113
 #define OPCODE_CLIENT_GET_SERVER_CONFIG (uint8_t)114
+#define OPCODE_CLIENT_SUBMIT_HEALTH (uint8_t)115
+#define OPCODE_CLIENT_SUBMIT_PROFILE (uint8_t)116
+#define OPCODE_CLIENT_SUBMIT_PUMP_MODEL (uint8_t)117
+#define OPCODE_CLIENT_SUBMIT_PROBE_ALERT (uint8_t)118
+#define OPCODE_SUBMIT_M_AT (uint8_t)119
 #define OPCODE_ESP8266_LOG 120
 #define OPCODE_SERVER_DEBUG_ESP8266_RESET (uint8_t)121
 #define OPCODE_SERVER_DEBUG_ESP8266_RESTART (uint8_t)122
 #define OPCODE_SERVER_DEBUG_ESP8266_DISCONNECT_TCP (uint8_t)123
+#define OPCODE_ESP8266_HEALTH (uint8_t)124
+#define OPCODE_SERVER_DEBUG_GET_PROFILE (uint8_t)125
+#define OPCODE_ESP8266_PROFILE (uint8_t)126
+#define OPCODE_ESP8266_SLEEP (uint8_t)127
+#define OPCODE_ESP8266_AWAKE (uint8_t)128
+#define OPCODE_ESP8266_WAKE_STATS (uint8_t)129
+#define OPCODE_SERVER_OTA_BEGIN (uint8_t)130
+#define OPCODE_SERVER_OTA_CHUNK (uint8_t)131
+#define OPCODE_SERVER_OTA_END (uint8_t)132
+#define OPCODE_CLIENT_OTA_ACK (uint8_t)133
+#define OPCODE_SERVER_DEBUG_GET_CAPTURE (uint8_t)134
+#define OPCODE_ESP8266_CAPTURE (uint8_t)135
+#define OPCODE_ESP8266_TIME (uint8_t)136
+#define OPCODE_ESP8266_QUEUE_STATS (uint8_t)137
+#define OPCODE_CLIENT_SUBMIT_QUEUE_STATS (uint8_t)138
+#define OPCODE_NODE_SELECT (uint8_t)140
+#define OPCODE_BUS_POLL (uint8_t)141
+#define OPCODE_BUS_POLL_END (uint8_t)142
 #define EOP (uint8_t)0x00
 
 #define PACKET_CONFIG_PAYLOAD_SIZE 16
+#define PACKET_HEALTH_PAYLOAD_SIZE 4
+#define PACKET_ESP8266_HEALTH_PAYLOAD_SIZE 17
+#define PACKET_PUMP_MODEL_PAYLOAD_SIZE 8
+#define PACKET_PROBE_ALERT_PAYLOAD_SIZE 4
+// SUBMIT_M_AT：M u8, epoch_s u32
+#define PACKET_M_AT_PAYLOAD_SIZE 5
+// TIME_PING：t1 u32（ESP8266 的 millis）, last_rtt_ms u16（還沒有量到時為 UINT16_MAX）
+#define PACKET_TIME_PING_PAYLOAD_SIZE 6
+// TIME_PONG：t1 u32（原樣送回）, t2 u64, t3 u64（server 收到和送出時的 Unix epoch ms）
+#define PACKET_TIME_PONG_PAYLOAD_SIZE 20
+// ESP8266_TIME：epoch_s u32, epoch_ms u16
+#define PACKET_TIME_PAYLOAD_SIZE 6
+// arduino_controller 的 QUEUE_STATS：2 個佇列 * (max_depth u16, max_wait_ms u16, dropped u16)
+#define PACKET_CLIENT_QUEUE_STATS_PAYLOAD_SIZE 12
+// arduino_controller 的 profile：5 bytes 標頭 + 4 個階段 * 16 個 bucket * uint16_t
+#define PACKET_PROFILE_PAYLOAD_SIZE 133
+// OTA_BEGIN：target u8, image_size u32, md5[16]
+#define PACKET_OTA_BEGIN_PAYLOAD_SIZE 21
+// OTA_CHUNK 標頭：offset u32, length u16，後面接 length bytes 的資料
+#define PACKET_OTA_CHUNK_HEADER_SIZE 6
+// OTA_ACK：status u8, offset u32
+#define PACKET_OTA_ACK_PAYLOAD_SIZE 5
+// WAKE_STATS：cycle_count u32, last_awake_ms u32, rtc_valid u8
+#define PACKET_WAKE_STATS_PAYLOAD_SIZE 9
+// GET_CAPTURE：file u8（0 = 這次開機，1 = 上次開機）
+#define PACKET_GET_CAPTURE_PAYLOAD_SIZE 1
+// CAPTURE 標頭：offset u32, length u16，後面接 length bytes 的資料，length 為 0 代表結束
+#define PACKET_CAPTURE_HEADER_SIZE 6
+// 封包 payload 的最大長度（payload 直接放在 Packet 裡，不使用 heap）
+#define PACKET_MAX_PAYLOAD_SIZE PACKET_PROFILE_PAYLOAD_SIZE
+
+// OTA 更新，映像檔可以是 gzip 壓縮過的（由 eboot 在開機時解壓縮）
+#define OTA_CHUNK_MAX_SIZE 1024
+#define OTA_TARGET_ESP8266 0
+#define OTA_TARGET_UNO 1
+#define OTA_STATUS_OK 0
+#define OTA_STATUS_DONE 1
+#define OTA_STATUS_ERROR 2
+
+// 低功耗模式，編譯時加上 -D LOW_POWER_MODE 才會啟用（arduino_controller 也要一起開啟）
+// 閒置一段時間後進入 deep sleep，由 arduino_controller 拉低 ESP8266_EN_PIN 喚醒。
+// ESP8266_EN_PIN 要接到 ESP-01 的 RST（EN 維持拉高），RTC memory 才會在喚醒後保留
+#define LOW_POWER_IDLE_MS 2000
+// 一直連不上 server 時最多保持清醒的時間
+#define LOW_POWER_MAX_AWAKE_MS 30000
+// 送出 SLEEP 之後等待 arduino_controller 是否剛好在送資料
+#define LOW_POWER_SLEEP_GRACE_MS 50
+// 用上次的 BSSID/channel 快速連線的逾時
+#define LOW_POWER_QUICK_CONNECT_MS 3000
+// 連不上 server 時暫存在 RTC memory 的 M 數量
+#define RTC_PENDING_SAMPLE_COUNT 16
+
+// 多節點 serial bus（RS-485），編譯時加上 -D MULTIDROP_BUS 才會啟用（arduino_controller 也要一起開啟）
+// serial 上每個封包前面加上 [節點位址][payload 長度]，ESP8266 依序 poll 每個節點，
+// 節點只在被 poll 時送出暫存的封包，最後以 BUS_POLL_END 交還 bus。
+// TCP 上以 OPCODE_NODE_SELECT [node] 標示下一個封包屬於哪個節點
+#define BUS_BROADCAST (uint8_t)0xFF
+#define BUS_DE_PIN 0
+#define BUS_POLL_INTERVAL_MS 20
+// 節點每次 poll 最多回 arduino_controller 的 BUS_POLL_REPLY_MAX_BYTES（64）或一個 profile（139 bytes），
+// 加上 POLL_END 4 bytes，9600 baud 最長約 150 ms，再留給節點 loop() 的延遲。
+// 逾時太短時下一個節點會和還在送資料的節點同時驅動 bus
+#define BUS_POLL_TIMEOUT_MS 250
+#define BUS_RX_ADDRESS 0
+#define BUS_RX_LENGTH 1
+#define BUS_RX_FRAME 2
+
+#if defined(MULTIDROP_BUS) && defined(LOW_POWER_MODE)
+#error "MULTIDROP_BUS and LOW_POWER_MODE cannot be enabled together"
+#endif
+
+// 時間同步，編譯時加上 -D CLOCK_SYNC 才會啟用（server 要支援 TIME_PING/TIME_PONG）
+// 以 TIME_PING/TIME_PONG 取代 PING/PONG，用 NTP 的四個時間戳估計 Unix epoch 和 millis() 的差距，
+// 再定時把 epoch 送給 arduino_controller
+// RTT 超過這個值或比最近的最小 RTT 慢太多的樣本不採用
+#define CLOCK_MAX_RTT_MS 2000
+#define CLOCK_RTT_SLACK_MS 20
+// 誤差超過這個值就直接跳到新的時間，否則慢慢修正
+#define CLOCK_STEP_MS 1000
+#define CLOCK_SLEW_DIVISOR 4
+// 估計 millis() 漂移所用的最短時間間隔
+#define CLOCK_DRIFT_SPAN_MS 600000
+#define CLOCK_MAX_DRIFT 0.0005
+#define CLOCK_SERIAL_INTERVAL_MS 60000
+// 9600 baud 送出 ESP8266_TIME 封包所需的時間
+#define CLOCK_SERIAL_LATENCY_MS 8
+
+// 記錄 serial 和 TCP 上收發的資料，編譯時加上 -D CAPTURE_LINKS 才會啟用，用 tools/replay.py 重播
+// 檔案開頭是 "CO3C" + version u8，之後每筆記錄為 t_ms u32, link u8, length u16，後面接 length bytes。
+// 同一個 ms 內同一個 link 的資料會併成一筆。開機時把上次的記錄改名成 CAPTURE_OLD_PATH，
+// 這次開機的記錄寫到 CAPTURE_MAX_FILE_SIZE 就停止，不會蓋掉上次開機的記錄。
+// 為了減少 flash 寫入，capture_buffer 快滿時和重啟、睡眠之前才寫到檔案，當機時會遺失 buffer 裡的資料
+#define CAPTURE_PATH "/capture.bin"
+#define CAPTURE_OLD_PATH "/capture.old.bin"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER_SIZE 512
+#define CAPTURE_RECORD_HEADER_SIZE 7
+// 和 Uno 的映像檔共用 64KB 的 LittleFS
+#define CAPTURE_MAX_FILE_SIZE 8192
+#define CAPTURE_CHUNK_SIZE 256
+#define CAPTURE_SERIAL_RX 0
+#define CAPTURE_SERIAL_TX 1
+#define CAPTURE_TCP_RX 2
+#define CAPTURE_TCP_TX 3
+// TCP 連線建立和關閉，length 為 0
+#define CAPTURE_TCP_OPEN 4
+#define CAPTURE_TCP_CLOSE 5
+
+#ifdef CAPTURE_LINKS
+#define CAPTURE(link, data, length) capture_write(link, data, length)
+#else
+#define CAPTURE(link, data, length)
+#endif
+
+// 燒錄 arduino_controller，Uno 使用 optiboot（STK500v1，115200 baud）
+// 接線：ESP8266 TX 也要接到 Uno D0，GPIO2 經 100nF 電容接到 Uno RESET（與 USB-serial 的 DTR 相同）。
+// Uno D1 平常是 115200 baud 的除錯輸出，不能直接接到 ESP8266 RX，否則會混進 9600 baud 的封包：
+// D1 經三態 buffer（74HC125，/OE 接 GPIO0）接到 ESP8266 RX，只有燒錄期間 GPIO0 拉低才導通。
+// GPIO0 開機時被上拉，buffer 預設不導通。MULTIDROP_BUS 的 GPIO0 是 RS-485 的 DE，不支援燒錄 Uno
+#define UNO_RESET_PIN 2
+#define UNO_RX_ENABLE_PIN 0
+#define UNO_RESET_PULSE_MS 50
+#define UNO_BOOTLOADER_START_MS 50
+#define UNO_BOOTLOADER_BAUD 115200
+#define UNO_FLASH_SIZE 32256
+#define UNO_IMAGE_PATH "/uno.bin"
+
+// loop() 各階段的耗時統計，編譯時加上 -D PROFILE_LOOP 才會啟用
+// 以 CPU cycle 計數，bucket i 約為 [2^(i+6), 2^(i+7)) 個 cycle
+#define PROFILE_STAGE_LOOP 0
+#define PROFILE_STAGE_TCP_READ 1
+#define PROFILE_STAGE_SERIAL_READ 2
+#define PROFILE_STAGE_TCP_WRITE 3
+#define PROFILE_STAGE_COUNT 4
+#define PROFILE_BUCKET_COUNT 16
+#define PROFILE_BUCKET_SHIFT 6
+
+#ifdef PROFILE_LOOP
+#define PROFILE_BEGIN(stage) uint32_t profile_start_##stage = ESP.getCycleCount()
+#define PROFILE_END(stage) profile_record(stage, ESP.getCycleCount() - profile_start_##stage)
+#else
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+#endif
+
+// TCP 收發緩衝區大小（靜態配置，不在每個封包上配置記憶體）
+#define TCP_RX_BUFFER_SIZE 64
+#define TCP_TX_BUFFER_SIZE 32
+
+// 送給 arduino_controller 的封包依優先順序排隊：控制 > 遙測 > log，同一個封包送完才會換佇列。
+// 佇列中每個封包以 [封包長度 u16][排入時間 u16] 開頭。多節點 bus 由 poll 決定送出時機，不使用佇列
+#ifndef MULTIDROP_BUS
+#define SERIAL_TX_QUEUES
+#endif
+#define SERIAL_TX_CONTROL_SIZE 256
+#define SERIAL_TX_TELEMETRY_SIZE 64
+#define SERIAL_TX_LOG_SIZE 512
+#define TX_FRAME_HEADER_SIZE 4
+// UART FIFO 只補到 SERIAL_TX_FIFO_LIMIT bytes，新的控制封包不用等 FIFO 裡一大段 log 送完
+#define SERIAL_TX_FIFO_SIZE 128
+#define SERIAL_TX_FIFO_LIMIT 8
+// log 訊息超過這個長度就截斷
+#define SERIAL_LOG_MAX_SIZE 48
+// 9600 baud 8N1 送一個 byte 的時間
+#define SERIAL_BYTE_US 1042
+#define TX_QUEUE_CONTROL 0
+#define TX_QUEUE_TELEMETRY 1
+#define TX_QUEUE_LOG 2
+#define TX_QUEUE_COUNT 3
+// ESP8266_QUEUE_STATS：每個佇列 max_depth u16, max_wait_ms u16, dropped u16，回報後歸零
+#define PACKET_QUEUE_STATS_PAYLOAD_SIZE (TX_QUEUE_COUNT * 6)
 
 typedef struct
 {
   uint8_t opcode;
-  uint8_t *payload;
+  uint8_t payload[PACKET_MAX_PAYLOAD_SIZE];
   size_t payload_size;
 } Packet;
 
+typedef struct
+{
+  uint8_t *buffer;
+  uint16_t size;
+  uint16_t head;
+  uint16_t length;
+  // 上次回報之後的統計
+  uint16_t max_depth;
+  uint16_t max_wait_ms;
+  uint16_t dropped;
+} TxQueue;
+
 typedef struct
 {
   const char *ssid;
   const char *password;
 } WiFiCredentials;
 
+typedef struct
+{
+  const char *host;
+  uint16_t port;
+  // 平滑後的延遲，0 代表還沒量過
+  uint16_t latency_ms;
+  uint8_t failures;
+  unsigned long retry_ms;
+} ServerEndpoint;
+
+// deep sleep 期間保留在 RTC memory 的狀態，大小必須是 4 的倍數
+typedef struct
+{
+  uint32_t crc;
+  uint32_t cycle_count;
+  uint32_t last_awake_ms;
+  int32_t wifi_channel;
+  uint8_t wifi_bssid[6];
+  uint8_t wifi_index;
+  uint8_t pending_count;
+  uint8_t pending_M[RTC_PENDING_SAMPLE_COUNT];
+} RtcState;
+
 WiFiCredentials wifi_list[] = {
     {"9G", "chee8888"},
     {"CH4", "chee8888"},
     {"Galaxy A21s5CF7", "94878787"},
 };
 
+// 要加入其他 server 時加在後面（WebSocket 的 server 要使用同一張憑證）
+ServerEndpoint endpoint_list[] = {
+    {TCP_HOST, TCP_PORT},
+};
+
+uint8_t endpoint_index = 0;
+uint8_t endpoint_probe_index = 0;
+
 bool tcp_connecting = false;
 bool tcp_connected = false;
-WiFiClient tcp_client;
+// 量測最近一次 PING 到 PONG 的 RTT（只記錄在 log，不用來選擇 server）
+bool tcp_ping_pending = false;
+unsigned long tcp_ping_sent_ms = 0;
+// 最後一次收到 server 資料的時間，連線建立時也會更新，用來判斷 PONG 逾時
+unsigned long tcp_last_received_ms = 0;
+uint8_t tcp_rx_buffer[TCP_RX_BUFFER_SIZE];
+uint8_t tcp_tx_buffer[TCP_TX_BUFFER_SIZE];
+Packet tcp_packet = {OPCODE_EMPTY, {0}, (size_t)0};
+Packet serial_packet = {OPCODE_EMPTY, {0}, (size_t)0};
+
+// 開機以來觀察到的最小剩餘 heap
+uint32_t min_free_heap = UINT32_MAX;
+
+// OTA 傳輸狀態，斷線重連後 server 再送一次相同的 OTA_BEGIN 就會從 ota_offset 繼續
+uint8_t ota_target = OTA_TARGET_ESP8266;
+uint32_t ota_size = 0;
+uint32_t ota_offset = 0;
+uint8_t ota_md5[16];
+uint8_t ota_chunk[OTA_CHUNK_MAX_SIZE];
+uint32_t ota_chunk_offset = 0;
+uint16_t ota_chunk_length = 0;
+uint16_t ota_chunk_received = 0;
+// 燒錄 Uno 用的映像檔和 MD5
+File ota_file;
+// 燒錄中的 Uno 映像檔
+File uno_image;
+MD5Builder ota_md5_builder;
+
+#ifdef MULTIDROP_BUS
+uint8_t bus_nodes[] = {1, 2, 3, 4};
+uint8_t bus_poll_index = 0;
+bool bus_polling = false;
+unsigned long bus_poll_ms = 0;
+// 正在 bus_wait_idle() 裡處理節點送來的封包，節點還佔著 bus
+bool bus_waiting = false;
+// 目前收到的封包來自哪個節點
+uint8_t bus_rx_state = BUS_RX_ADDRESS;
+uint8_t bus_rx_node = BUS_BROADCAST;
+uint16_t bus_rx_remaining = 0;
+// server 以 NODE_SELECT 指定下一個封包要轉給哪個節點
+uint8_t tcp_node = BUS_BROADCAST;
+#endif
+
+#ifdef SERIAL_TX_QUEUES
+uint8_t serial_tx_control_buffer[SERIAL_TX_CONTROL_SIZE];
+uint8_t serial_tx_telemetry_buffer[SERIAL_TX_TELEMETRY_SIZE];
+uint8_t serial_tx_log_buffer[SERIAL_TX_LOG_SIZE];
+TxQueue serial_tx_queues[TX_QUEUE_COUNT] = {
+    {serial_tx_control_buffer, SERIAL_TX_CONTROL_SIZE},
+    {serial_tx_telemetry_buffer, SERIAL_TX_TELEMETRY_SIZE},
+    {serial_tx_log_buffer, SERIAL_TX_LOG_SIZE},
+};
+// 正在送出的封包所在的佇列和還沒送出的 byte 數
+TxQueue *serial_tx_current = NULL;
+uint16_t serial_tx_remaining = 0;
+#endif
+
+#ifdef CLOCK_SYNC
+// Unix epoch ms = clock_ref_epoch_ms + (millis() - clock_ref_ms) * (1 + clock_drift)
+bool clock_synced = false;
+// 時間跳動過，要盡快通知 arduino_controller
+bool clock_stepped = false;
+uint32_t clock_ref_ms = 0;
+int64_t clock_ref_epoch_ms = 0;
+float clock_drift = 0;
+// 估計漂移用的錨點
+uint32_t clock_drift_ref_ms = 0;
+int64_t clock_drift_ref_epoch_ms = 0;
+uint16_t clock_last_rtt_ms = UINT16_MAX;
+uint16_t clock_min_rtt_ms = UINT16_MAX;
+#endif
+
+#ifdef CAPTURE_LINKS
+File capture_file;
+uint8_t capture_buffer[CAPTURE_BUFFER_SIZE];
+size_t capture_length = 0;
+// 最後一筆記錄在 capture_buffer 中的位置，還可以往後併入資料
+size_t capture_record = SIZE_MAX;
+uint8_t capture_record_link = 0;
+uint32_t capture_record_ms = 0;
+bool capture_paused = false;
+// 這次開機的記錄已經寫滿
+bool capture_full = false;
+#endif
+
+#ifdef LOW_POWER_MODE
+RtcState rtc_state;
+bool rtc_state_valid = false;
+// 上一輪清醒時間每次開機只回報一次，重新連線時不重複回報
+bool wake_stats_sent = false;
+#endif
+
+#ifdef PROFILE_LOOP
+uint32_t profile_histograms[PROFILE_STAGE_COUNT][PROFILE_BUCKET_COUNT];
+#endif
 
 void connect_to_best_wifi();
+#ifdef LOW_POWER_MODE
+bool connect_to_last_wifi();
+uint32_t rtc_state_crc();
+void rtc_load();
+void rtc_save();
+void rtc_push_sample(uint8_t M);
+void tcp_send_pending_samples();
+bool enter_deep_sleep();
+#endif
 void maintain_wifi();
 bool maintain_tcp();
+uint8_t select_endpoint();
+void endpoint_failed(ServerEndpoint &endpoint);
+void endpoint_record_latency(ServerEndpoint &endpoint, uint32_t latency_ms);
+bool endpoint_measure(ServerEndpoint &endpoint);
+void tcp_on_pong();
+void probe_endpoint();
 
 void tcp_close();
+void tcp_packet_handler(uint8_t incoming);
+void tcp_send_health();
+#ifdef SERIAL_TX_QUEUES
+void tcp_send_queue_stats();
+#endif
+bool ota_running();
+void ota_begin(uint8_t *payload);
+void ota_write_chunk();
+void ota_end();
+void ota_ack(uint8_t status);
+void uno_ota_end();
+bool uno_flash();
+int uno_port_available();
+int uno_port_read();
+size_t uno_port_write(const uint8_t *data, size_t length);
+size_t uno_port_read_bytes(uint8_t *buffer, size_t length, unsigned long timeout_ms);
+size_t uno_image_read(uint8_t *buffer, size_t size);
+#ifdef CLOCK_SYNC
+int64_t clock_epoch_ms(uint32_t ms);
+void clock_ping();
+void clock_sample(uint8_t *payload, uint32_t t4);
+void clock_send_serial();
+#endif
+#ifdef CAPTURE_LINKS
+void capture_open();
+void capture_write(uint8_t link, const uint8_t *data, size_t length);
+void capture_flush();
+void tcp_send_capture(uint8_t file);
+#endif
+#ifdef PROFILE_LOOP
+void profile_record(uint8_t stage, uint32_t cycles);
+void tcp_send_profile();
+#endif
 inline void tcp_send(Packet *packet);
 void tcp_send(uint8_t opcode, uint8_t *payload, size_t payload_size);
 inline void serial_send(Packet *packet);
 void serial_send(uint8_t opcode, uint8_t *payload, size_t payload_size);
+void serial_write(const uint8_t *data, size_t length);
+void serial_write(uint8_t data);
 void serial_println(String message);
+#ifdef SERIAL_TX_QUEUES
+bool serial_tx_enqueue(uint8_t priority, uint8_t opcode, const uint8_t *payload, size_t payload_size);
+uint8_t serial_tx_priority(uint8_t opcode);
+void tx_queue_push(TxQueue *queue, const uint8_t *data, size_t length);
+uint8_t tx_queue_pop(TxQueue *queue);
+bool serial_tx_pending();
+size_t serial_tx_backlog(uint8_t priority);
+void serial_tx_pump();
+#endif
+void serial_tx_drain();
+void serial_packet_handler(uint8_t incoming);
+size_t serial_payload_size(uint8_t opcode);
+#ifdef MULTIDROP_BUS
+void bus_wait_idle();
+bool bus_begin_frame(uint8_t node, size_t payload_size);
+void bus_poll_done();
+void bus_end_frame();
+void bus_poll();
+void bus_packet_handler(uint8_t incoming);
+#endif
 void reset_packet(Packet *packet);
 bool push_packet_payload(Packet *packet, uint8_t data);
 
 void connect_to_best_wifi()
 {
+#ifdef LOW_POWER_MODE
+  // 先用上次的 BSSID/channel 連線，省去掃描
+  if (connect_to_last_wifi())
+  {
+    return;
+  }
+#endif
+
   int wifi_count = WiFi.scanNetworks();
   if (wifi_count == 0)
   {
@@ -76,6 +512,7 @@ void connect_to_best_wifi()
   int best_signal_strength = -100;
   const char *best_ssid = nullptr;
   const char *best_password = nullptr;
+  uint8_t best_index = 0;
 
   for (int i = 0; i < wifi_count; i++)
   {
@@ -89,6 +526,7 @@ void connect_to_best_wifi()
         best_signal_strength = signal_strength;
         best_ssid = credentials.ssid;
         best_password = credentials.password;
+        best_index = &credentials - wifi_list;
       }
     }
   }
@@ -110,6 +548,12 @@ void connect_to_best_wifi()
       msg = "IP address: ";
       msg.concat(WiFi.localIP().toString());
       serial_println(msg);
+#ifdef LOW_POWER_MODE
+      rtc_state.wifi_index = best_index;
+      rtc_state.wifi_channel = WiFi.channel();
+      memcpy(rtc_state.wifi_bssid, WiFi.BSSID(), 6);
+      rtc_save();
+#endif
     }
     else
     {
@@ -122,6 +566,139 @@ void connect_to_best_wifi()
   }
 }
 
+#ifdef LOW_POWER_MODE
+bool connect_to_last_wifi()
+{
+  if (!rtc_state_valid || rtc_state.wifi_channel == 0 || rtc_state.wifi_index >= sizeof(wifi_list) / sizeof(wifi_list[0]))
+  {
+    return false;
+  }
+
+  WiFiCredentials &credentials = wifi_list[rtc_state.wifi_index];
+  WiFi.begin(credentials.ssid, credentials.password, rtc_state.wifi_channel, rtc_state.wifi_bssid);
+  unsigned long start_attempt_time = millis();
+  while (WiFi.status() != WL_CONNECTED && millis() - start_attempt_time < LOW_POWER_QUICK_CONNECT_MS)
+  {
+    delay(10);
+  }
+
+  if (WiFi.status() != WL_CONNECTED)
+  {
+    // AP 換了 channel 或不在了，改用完整掃描
+    rtc_state.wifi_channel = 0;
+    return false;
+  }
+
+  String msg = "Wi-Fi reconnected, SSID: ";
+  msg.concat(credentials.ssid);
+  serial_println(msg);
+  return true;
+}
+
+uint32_t rtc_state_crc()
+{
+  const uint8_t *data = (const uint8_t *)&rtc_state + sizeof(rtc_state.crc);
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (size_t i = 0; i < sizeof(rtc_state) - sizeof(rtc_state.crc); i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+
+  return ~crc;
+}
+
+void rtc_load()
+{
+  ESP.rtcUserMemoryRead(0, (uint32_t *)&rtc_state, sizeof(rtc_state));
+  rtc_state_valid = rtc_state.crc == rtc_state_crc();
+  if (!rtc_state_valid)
+  {
+    // 冷開機或 RTC memory 沒有保留
+    memset(&rtc_state, 0, sizeof(rtc_state));
+  }
+}
+
+void rtc_save()
+{
+  rtc_state.crc = rtc_state_crc();
+  ESP.rtcUserMemoryWrite(0, (uint32_t *)&rtc_state, sizeof(rtc_state));
+}
+
+void rtc_push_sample(uint8_t M)
+{
+  if (rtc_state.pending_count == RTC_PENDING_SAMPLE_COUNT)
+  {
+    // 滿了就丟掉最舊的
+    memmove(rtc_state.pending_M, rtc_state.pending_M + 1, RTC_PENDING_SAMPLE_COUNT - 1);
+    rtc_state.pending_count--;
+  }
+  rtc_state.pending_M[rtc_state.pending_count++] = M;
+  rtc_save();
+}
+
+void tcp_send_pending_samples()
+{
+  uint8_t payload[PACKET_WAKE_STATS_PAYLOAD_SIZE];
+
+  // 上一輪清醒的時間，供 server 統計每個回報週期的耗電
+  if (!wake_stats_sent)
+  {
+    memcpy(payload, &rtc_state.cycle_count, 4);
+    memcpy(payload + 4, &rtc_state.last_awake_ms, 4);
+    payload[8] = rtc_state_valid;
+    tcp_send(OPCODE_ESP8266_WAKE_STATS, payload, sizeof(payload));
+    wake_stats_sent = true;
+  }
+
+  for (uint8_t i = 0; i < rtc_state.pending_count; i++)
+  {
+    tcp_send(OPCODE_SUBMIT_M, &rtc_state.pending_M[i], 1);
+  }
+  if (rtc_state.pending_count)
+  {
+    rtc_state.pending_count = 0;
+    rtc_save();
+  }
+}
+
+bool enter_deep_sleep()
+{
+  serial_send(OPCODE_ESP8266_SLEEP, NULL, 0);
+  serial_tx_drain();
+  Serial.flush();
+
+  // arduino_controller 剛好在送資料時不要睡
+  delay(LOW_POWER_SLEEP_GRACE_MS);
+  if (Serial.available())
+  {
+    serial_send(OPCODE_ESP8266_AWAKE, NULL, 0);
+    return false;
+  }
+
+  if (tcp_connected)
+  {
+    transport_flush();
+    transport_stop();
+  }
+
+  rtc_state.cycle_count++;
+  rtc_state.last_awake_ms = millis();
+  rtc_save();
+#ifdef CAPTURE_LINKS
+  capture_flush();
+#endif
+
+  // 不設定喚醒時間，等 arduino_controller 觸發 RST
+  ESP.deepSleep(0);
+  return true;
+}
+#endif
+
 void maintain_wifi()
 {
   if (WiFi.status() != WL_CONNECTED)
@@ -139,284 +716,1574 @@ bool maintain_tcp()
   if (tcp_connecting || tcp_connected)
     return false;
 
-  serial_println("TCP connecting...");
+  endpoint_index = select_endpoint();
+  ServerEndpoint &endpoint = endpoint_list[endpoint_index];
+
+  String msg = "TCP connecting to ";
+  msg.concat(endpoint.host);
+  serial_println(msg);
   tcp_connecting = true;
-  if (tcp_client.connect(TCP_HOST, TCP_PORT))
+
+  // 認證頭
+  String auth_message = "CO3006-Name: ";
+  auth_message += WiFi.macAddress();
+  auth_message += "\r\nCO3006-Auth: ";
+  auth_message += API_KEY;
+  auth_message += "\r\nCO3006-WiFi: ";
+  auth_message += WiFi.SSID();
+  auth_message += "\r\nCO3006-Local-IP: ";
+  auth_message += WiFi.localIP().toString();
+
+  if (transport_connect(endpoint.host, endpoint.port, auth_message))
   {
-    tcp_client.setTimeout(10000);
+    CAPTURE(CAPTURE_TCP_OPEN, NULL, 0);
+    CAPTURE(CAPTURE_TCP_TX, (const uint8_t *)auth_message.c_str(), auth_message.length());
     tcp_connected = true;
     tcp_connecting = false;
-
-    // 發送認證頭
-    String auth_message = "CO3006-Name: ";
-    auth_message += WiFi.macAddress();
-    auth_message += "\r\nCO3006-Auth: ";
-    auth_message += API_KEY;
-    auth_message += "\r\nCO3006-WiFi: ";
-    auth_message += WiFi.SSID();
-    auth_message += "\r\nCO3006-Local-IP: ";
-    auth_message += WiFi.localIP().toString();
-    tcp_client.print(auth_message);
+    tcp_last_received_ms = millis();
     serial_println("TCP connected");
+#ifdef LOW_POWER_MODE
+    // 喚醒後通常在 setup() 就連上了，每次建立連線時都要送出 RTC memory 裡的資料
+    tcp_send_pending_samples();
+#endif
     return true;
   }
   else
   {
     tcp_connecting = false;
     serial_println("TCP connection failed");
+    endpoint_failed(endpoint);
     delay(100);
     return false;
   }
 }
 
-void tcp_close()
-{
-  tcp_client.stop();
-  tcp_connecting = false;
-  tcp_connected = false;
-  serial_println("TCP closed");
-}
-
-inline void tcp_send(Packet *packet)
+uint8_t select_endpoint()
 {
-  tcp_send(packet->opcode, packet->payload, packet->payload_size);
-}
+  unsigned long current_ms = millis();
+  uint32_t best_score = UINT32_MAX;
+  uint8_t best_index = 0;
 
-void tcp_send(uint8_t opcode, uint8_t *payload, size_t payload_size)
-{
-  uint8_t *buffer = (uint8_t *)malloc(payload_size + 1);
-  buffer[0] = opcode;
-  memcpy(buffer + 1, payload, payload_size);
-  tcp_client.write(buffer, payload_size + 1);
-}
+  for (auto &endpoint : endpoint_list)
+  {
+    uint32_t score = endpoint.latency_ms ? endpoint.latency_ms : ENDPOINT_UNKNOWN_LATENCY_MS;
+    if (endpoint.failures && (long)(endpoint.retry_ms - current_ms) > 0)
+    {
+      // 全部都失敗時，選最快可以重試的
+      score += ENDPOINT_UNHEALTHY_PENALTY_MS + (endpoint.retry_ms - current_ms);
+    }
+    if (score < best_score)
+    {
+      best_score = score;
+      best_index = &endpoint - endpoint_list;
+    }
+  }
 
-inline void serial_send(Packet *packet)
-{
-  serial_send(packet->opcode, packet->payload, packet->payload_size);
+  return best_index;
 }
 
-void serial_send(uint8_t opcode, uint8_t *payload, size_t payload_size)
+void endpoint_failed(ServerEndpoint &endpoint)
 {
-  Serial.write(opcode);
-  Serial.write(payload, payload_size);
-  Serial.write(EOP);
+  // 指數退避
+  if (endpoint.failures < 16)
+  {
+    endpoint.failures++;
+  }
+  endpoint.retry_ms = millis() + min((unsigned long)ENDPOINT_RETRY_MS << min(endpoint.failures - 1, 6), (unsigned long)ENDPOINT_MAX_RETRY_MS);
 }
 
-void serial_println(String message)
+void endpoint_record_latency(ServerEndpoint &endpoint, uint32_t latency_ms)
 {
-  Serial.write(OPCODE_ESP8266_LOG);
-  Serial.write(message.c_str());
-  Serial.write('\n');
-  Serial.write(EOP);
+  latency_ms = constrain(latency_ms, (uint32_t)1, (uint32_t)UINT16_MAX);
+  if (endpoint.latency_ms)
+  {
+    endpoint.latency_ms += ((int32_t)latency_ms - endpoint.latency_ms) / 4;
+  }
+  else
+  {
+    endpoint.latency_ms = latency_ms;
+  }
+  endpoint.failures = 0;
 }
 
-void reset_packet(Packet *packet)
+void tcp_on_pong()
 {
-  packet->opcode = OPCODE_EMPTY;
-  free(packet->payload);
-  packet->payload = NULL;
-  packet->payload_size = (size_t)0;
+  if (tcp_ping_pending)
+  {
+    tcp_ping_pending = false;
+    String msg = "TCP on pong, RTT ";
+    msg.concat(millis() - tcp_ping_sent_ms);
+    msg.concat(" ms");
+    serial_println(msg);
+  }
 }
 
-bool push_packet_payload(Packet *packet, uint8_t data)
+// 量測 TCP 連線時間，連不上時回傳 false
+bool endpoint_measure(ServerEndpoint &endpoint)
 {
-  uint8_t *new_payload = (uint8_t *)realloc(packet->payload, ++packet->payload_size);
-
-  if (!new_payload)
+  WiFiClient probe;
+  probe.setTimeout(ENDPOINT_PROBE_TIMEOUT_MS);
+  unsigned long start_ms = millis();
+  if (!probe.connect(endpoint.host, endpoint.port))
   {
-    // memory error
-    reset_packet(packet);
-    ESP.reset();
     return false;
   }
 
-  packet->payload = new_payload;
-  packet->payload[packet->payload_size - 1] = data;
-
+  endpoint_record_latency(endpoint, millis() - start_ms);
+  probe.stop();
   return true;
 }
 
-void setup()
-{
-  Serial.begin(9600);
-  tcp_client.setNoDelay(true);
-  maintain_wifi();
-  serial_println("setup done");
-}
-
-void loop()
+// 用同樣的方式量測下一個 server 和目前 server 的 TCP 連線時間，下一個快很多就斷線重新選擇
+void probe_endpoint()
 {
-  static unsigned long last_tcp_ping_ms = 0;
-  static unsigned long last_tcp_last_received_ms = 0;
-  static unsigned long current_ms = 0;
-  static uint8_t incoming;
-  static Packet tcp_packet = {OPCODE_EMPTY, NULL, (size_t)0};
-  static Packet serial_packet = {OPCODE_EMPTY, NULL, (size_t)0};
+  const size_t endpoint_count = sizeof(endpoint_list) / sizeof(endpoint_list[0]);
 
-  current_ms = millis();
+  if (endpoint_count < 2)
+  {
+    return;
+  }
 
-  if (WiFi.status() != WL_CONNECTED)
+  endpoint_probe_index = (endpoint_probe_index + 1) % endpoint_count;
+  if (endpoint_probe_index == endpoint_index)
   {
-    maintain_wifi();
+    endpoint_probe_index = (endpoint_probe_index + 1) % endpoint_count;
+  }
+  if (!endpoint_measure(endpoint_list[endpoint_probe_index]))
+  {
+    endpoint_failed(endpoint_list[endpoint_probe_index]);
+    return;
+  }
+  // 目前的 server 量測失敗時不切換，連線是否正常由 PONG 逾時判斷
+  if (!endpoint_measure(endpoint_list[endpoint_index]))
+  {
+    return;
   }
 
-  if (!tcp_connecting && !tcp_connected)
+  uint8_t best_index = select_endpoint();
+  if (best_index != endpoint_index &&
+      endpoint_list[best_index].latency_ms + ENDPOINT_SWITCH_MARGIN_MS < endpoint_list[endpoint_index].latency_ms)
   {
-    if (maintain_tcp())
-    {
-      last_tcp_last_received_ms = current_ms;
-    }
+    serial_println("switching to faster server");
+    tcp_close();
   }
+}
 
-  // heartbeat
-  if (tcp_connected)
+void tcp_close()
+{
+  CAPTURE(CAPTURE_TCP_CLOSE, NULL, 0);
+  transport_stop();
+  tcp_connecting = false;
+  tcp_connected = false;
+  tcp_ping_pending = false;
+  // 斷在封包中間時丟掉收到一半的封包，下次連線的資料要從新的封包開始解析
+  reset_packet(&tcp_packet);
+  ota_chunk_length = 0;
+  ota_chunk_received = 0;
+  serial_println("TCP closed");
+}
+
+void tcp_packet_handler(uint8_t incoming)
+{
+  if (tcp_packet.opcode == OPCODE_EMPTY)
   {
-    if (current_ms - last_tcp_ping_ms >= TCP_PING_INTERVAL_MS)
+    tcp_packet.opcode = incoming;
+    // no payload packet handler
+    switch (tcp_packet.opcode)
     {
-      serial_println("TCP ping");
-      tcp_send(OPCODE_PING, NULL, 0);
-      last_tcp_ping_ms = current_ms;
-    }
+    case OPCODE_PING:
+      tcp_send(OPCODE_PONG, NULL, 0);
+      reset_packet(&tcp_packet);
+      serial_println("TCP on ping");
+      break;
 
-    if (current_ms - last_tcp_last_received_ms >= TCP_PONG_TIMEOUT_MS)
-    {
+    case OPCODE_PONG:
+      tcp_on_pong();
+      reset_packet(&tcp_packet);
+      break;
+
+    case OPCODE_SERVER_GET_CLIENT_CONFIG:
+      serial_send(&tcp_packet);
+      reset_packet(&tcp_packet);
+      break;
+
+    case OPCODE_SERVER_DEBUG_ESP8266_RESET:
+      serial_println("debug restart");
+      serial_tx_drain();
+#ifdef CAPTURE_LINKS
+      capture_flush();
+#endif
+      ESP.restart();
+      reset_packet(&tcp_packet);
+      break;
+
+    case OPCODE_SERVER_DEBUG_ESP8266_RESTART:
+      serial_println("debug reset");
+      serial_tx_drain();
+#ifdef CAPTURE_LINKS
+      capture_flush();
+#endif
+      ESP.reset();
+      reset_packet(&tcp_packet);
+      break;
+
+    case OPCODE_SERVER_DEBUG_GET_PROFILE:
+#ifdef PROFILE_LOOP
+      tcp_send_profile();
+#endif
+      // 一併向 arduino_controller 要它的 profile
+      serial_send(&tcp_packet);
+      reset_packet(&tcp_packet);
+      break;
+
+    case OPCODE_SERVER_DEBUG_ESP8266_DISCONNECT_TCP:
+      serial_println("debug disconnect");
       tcp_close();
+      reset_packet(&tcp_packet);
+      break;
+
+    case OPCODE_SERVER_OTA_END:
+      reset_packet(&tcp_packet);
+      ota_end();
+      break;
+
+    default:
+      break;
     }
   }
-
-  if (tcp_connected && tcp_client.available())
+  else
   {
-    last_tcp_last_received_ms = current_ms;
-    // read packet
-    do
+    switch (tcp_packet.opcode)
     {
-      incoming = (uint8_t)tcp_client.read();
+#ifdef MULTIDROP_BUS
+    case OPCODE_NODE_SELECT:
+      tcp_node = incoming;
+      reset_packet(&tcp_packet);
+      break;
+#endif
 
-      if (tcp_packet.opcode == OPCODE_EMPTY)
-      {
-        tcp_packet.opcode = incoming;
-        // no payload packet handler
-        switch (tcp_packet.opcode)
-        {
-        case OPCODE_PING:
-          tcp_send(OPCODE_PONG, NULL, 0);
-          reset_packet(&tcp_packet);
-          serial_println("TCP on ping");
-          break;
+#ifdef CAPTURE_LINKS
+    case OPCODE_SERVER_DEBUG_GET_CAPTURE:
+      reset_packet(&tcp_packet);
+      tcp_send_capture(incoming);
+      break;
+#endif
 
-        case OPCODE_PONG:
-          serial_println("TCP on pong");
-          reset_packet(&tcp_packet);
-          break;
+#ifdef CLOCK_SYNC
+    case OPCODE_TIME_PONG:
+      push_packet_payload(&tcp_packet, incoming);
+      if (tcp_packet.payload_size < PACKET_TIME_PONG_PAYLOAD_SIZE)
+      {
+        break;
+      }
+      tcp_on_pong();
+      clock_sample(tcp_packet.payload, millis());
+      reset_packet(&tcp_packet);
+      break;
+#endif
 
-        case OPCODE_SERVER_GET_CLIENT_CONFIG:
-          serial_send(&tcp_packet);
-          reset_packet(&tcp_packet);
-          break;
+    case OPCODE_SERVER_OTA_BEGIN:
+      push_packet_payload(&tcp_packet, incoming);
+      if (tcp_packet.payload_size < PACKET_OTA_BEGIN_PAYLOAD_SIZE)
+      {
+        break;
+      }
+      ota_begin(tcp_packet.payload);
+      reset_packet(&tcp_packet);
+      break;
 
-        case OPCODE_SERVER_DEBUG_ESP8266_RESET:
-          serial_println("debug restart");
-          ESP.restart();
-          reset_packet(&tcp_packet);
+    case OPCODE_SERVER_OTA_CHUNK:
+      if (tcp_packet.payload_size < PACKET_OTA_CHUNK_HEADER_SIZE)
+      {
+        push_packet_payload(&tcp_packet, incoming);
+        if (tcp_packet.payload_size < PACKET_OTA_CHUNK_HEADER_SIZE)
+        {
           break;
-
-        case OPCODE_SERVER_DEBUG_ESP8266_RESTART:
-          serial_println("debug reset");
-          ESP.reset();
+        }
+        memcpy(&ota_chunk_offset, tcp_packet.payload, 4);
+        memcpy(&ota_chunk_length, tcp_packet.payload + 4, 2);
+        ota_chunk_received = 0;
+        if (ota_chunk_length > OTA_CHUNK_MAX_SIZE)
+        {
+          // 無法得知封包邊界，斷線讓 server 重新從 ota_offset 開始
+          serial_println("OTA chunk too large");
           reset_packet(&tcp_packet);
-          break;
-
-        case OPCODE_SERVER_DEBUG_ESP8266_DISCONNECT_TCP:
-          serial_println("debug disconnect");
           tcp_close();
-          reset_packet(&tcp_packet);
           break;
-
-        default:
+        }
+        if (ota_chunk_length > 0)
+        {
           break;
         }
       }
       else
       {
-        switch (tcp_packet.opcode)
+        // 資料直接放進 ota_chunk，不經過 Packet
+        ota_chunk[ota_chunk_received++] = incoming;
+        if (ota_chunk_received < ota_chunk_length)
         {
-        case OPCODE_SERVER_SET_CLIENT_CONFIG:
-          push_packet_payload(&tcp_packet, incoming);
-          if (tcp_packet.payload_size < PACKET_CONFIG_PAYLOAD_SIZE)
-          {
-            break;
-          }
-          serial_send(&tcp_packet);
-          reset_packet(&tcp_packet);
-          break;
-
-        default:
-          reset_packet(&tcp_packet);
           break;
         }
       }
-    } while (tcp_connected && tcp_client.available());
-  }
-
-  if (Serial.available())
-  {
-    incoming = (uint8_t)Serial.read();
+      ota_write_chunk();
+      reset_packet(&tcp_packet);
+      break;
 
-    if (serial_packet.opcode == OPCODE_EMPTY)
-    {
-      serial_packet.opcode = incoming;
-    }
-    else
-    {
-      switch (serial_packet.opcode)
+    case OPCODE_SERVER_SET_CLIENT_CONFIG:
+      push_packet_payload(&tcp_packet, incoming);
+      if (tcp_packet.payload_size < PACKET_CONFIG_PAYLOAD_SIZE)
       {
-      case OPCODE_SUBMIT_M:
-        if (serial_packet.payload_size == 0)
-        {
-          push_packet_payload(&serial_packet, incoming);
-          break;
-        }
-        if (incoming == EOP)
-        {
-          if (serial_packet.payload_size == 1)
-          {
-            // 轉發封包
-            tcp_send(&serial_packet);
-          }
-        }
-        reset_packet(&serial_packet);
         break;
+      }
+      serial_send(&tcp_packet);
+      reset_packet(&tcp_packet);
+      break;
 
-      case OPCODE_CLIENT_SUBMIT_CONFIG:
-        if (serial_packet.payload_size < PACKET_CONFIG_PAYLOAD_SIZE)
-        {
-          push_packet_payload(&serial_packet, incoming);
-          break;
-        }
-        if (incoming == EOP)
-        {
-          // 轉發封包
-          tcp_send(&serial_packet);
-        }
-        reset_packet(&serial_packet);
+    default:
+      reset_packet(&tcp_packet);
+      break;
+    }
+  }
+}
+
+void tcp_send_health()
+{
+  uint8_t payload[PACKET_ESP8266_HEALTH_PAYLOAD_SIZE];
+  uint32_t free_heap = ESP.getFreeHeap();
+  uint32_t max_free_block = ESP.getMaxFreeBlockSize();
+  uint32_t free_cont_stack = ESP.getFreeContStack();
+
+  memcpy(payload, &free_heap, 4);
+  memcpy(payload + 4, &min_free_heap, 4);
+  memcpy(payload + 8, &max_free_block, 4);
+  memcpy(payload + 12, &free_cont_stack, 4);
+  payload[16] = ESP.getHeapFragmentation();
+  tcp_send(OPCODE_ESP8266_HEALTH, payload, sizeof(payload));
+}
+
+#ifdef SERIAL_TX_QUEUES
+void tcp_send_queue_stats()
+{
+  uint8_t payload[PACKET_QUEUE_STATS_PAYLOAD_SIZE];
+  uint8_t *p = payload;
+
+  for (auto &queue : serial_tx_queues)
+  {
+    memcpy(p, &queue.max_depth, 2);
+    memcpy(p + 2, &queue.max_wait_ms, 2);
+    memcpy(p + 4, &queue.dropped, 2);
+    p += 6;
+    queue.max_depth = queue.length;
+    queue.max_wait_ms = 0;
+    queue.dropped = 0;
+  }
+  tcp_send(OPCODE_ESP8266_QUEUE_STATS, payload, sizeof(payload));
+}
+#endif
+
+#ifdef PROFILE_LOOP
+void profile_record(uint8_t stage, uint32_t cycles)
+{
+  uint8_t bucket = 0;
+
+  cycles >>= PROFILE_BUCKET_SHIFT;
+  while (cycles > 1 && bucket < PROFILE_BUCKET_COUNT - 1)
+  {
+    cycles >>= 1;
+    bucket++;
+  }
+
+  if (profile_histograms[stage][bucket] < UINT32_MAX)
+  {
+    profile_histograms[stage][bucket]++;
+  }
+}
+
+void tcp_send_profile()
+{
+  static uint8_t payload[5 + sizeof(profile_histograms)];
+
+  payload[0] = PROFILE_STAGE_COUNT;
+  payload[1] = PROFILE_BUCKET_COUNT;
+  payload[2] = PROFILE_BUCKET_SHIFT;
+  payload[3] = sizeof(profile_histograms[0][0]);
+  payload[4] = F_CPU / 1000000L;
+  memcpy(payload + 5, profile_histograms, sizeof(profile_histograms));
+  tcp_send(OPCODE_ESP8266_PROFILE, payload, sizeof(payload));
+}
+#endif
+
+bool ota_running()
+{
+  if (ota_target == OTA_TARGET_UNO)
+  {
+    return (bool)ota_file;
+  }
+
+  return Update.isRunning();
+}
+
+void ota_begin(uint8_t *payload)
+{
+  uint8_t target = payload[0];
+  uint32_t size;
+  char md5_hex[33];
+
+  memcpy(&size, payload + 1, 4);
+
+#ifdef MULTIDROP_BUS
+  if (target != OTA_TARGET_ESP8266)
+#else
+  if (target != OTA_TARGET_ESP8266 && target != OTA_TARGET_UNO)
+#endif
+  {
+    serial_println("OTA unknown target");
+    ota_ack(OTA_STATUS_ERROR);
+    return;
+  }
+
+  // 同一個映像檔已經在傳輸中，從目前的位置繼續
+  if (target == ota_target && ota_running() && size == ota_size && memcmp(payload + 5, ota_md5, 16) == 0)
+  {
+    serial_println("OTA resume");
+    ota_ack(OTA_STATUS_OK);
+    return;
+  }
+
+  if (Update.isRunning())
+  {
+    // 放棄舊的映像檔，MD5 不符所以不會被寫入
+    Update.end(true);
+  }
+  if (ota_file)
+  {
+    ota_file.close();
+  }
+
+  ota_target = target;
+  ota_size = size;
+  ota_offset = 0;
+  memcpy(ota_md5, payload + 5, 16);
+
+  if (target == OTA_TARGET_UNO)
+  {
+    // Uno 的映像檔先存在 flash，收完並檢查 MD5 之後才燒錄
+    if (size > UNO_FLASH_SIZE || !(ota_file = LittleFS.open(UNO_IMAGE_PATH, "w")))
+    {
+      serial_println("OTA begin failed");
+      ota_ack(OTA_STATUS_ERROR);
+      return;
+    }
+    ota_md5_builder.begin();
+    serial_println("OTA begin (Uno)");
+    ota_ack(OTA_STATUS_OK);
+    return;
+  }
+
+  for (int i = 0; i < 16; i++)
+  {
+    sprintf(md5_hex + i * 2, "%02x", payload[5 + i]);
+  }
+
+  if (!Update.begin(size) || !Update.setMD5(md5_hex))
+  {
+    serial_println("OTA begin failed");
+    ota_ack(OTA_STATUS_ERROR);
+    return;
+  }
+
+  serial_println("OTA begin");
+  ota_ack(OTA_STATUS_OK);
+}
+
+void ota_write_chunk()
+{
+  size_t written;
+
+  // 位置不符時只回報目前的位置，由 server 從 ota_offset 重送
+  if (!ota_running() || ota_chunk_offset != ota_offset)
+  {
+    ota_ack(ota_running() ? OTA_STATUS_OK : OTA_STATUS_ERROR);
+    return;
+  }
+
+  if (ota_target == OTA_TARGET_UNO)
+  {
+    written = ota_file.write(ota_chunk, ota_chunk_length);
+    ota_md5_builder.add(ota_chunk, written);
+  }
+  else
+  {
+    written = Update.write(ota_chunk, ota_chunk_length);
+  }
+
+  if (written != ota_chunk_length)
+  {
+    serial_println("OTA write failed");
+    ota_ack(OTA_STATUS_ERROR);
+    return;
+  }
+
+  ota_offset += ota_chunk_length;
+  ota_ack(OTA_STATUS_OK);
+}
+
+void ota_end()
+{
+  if (ota_target == OTA_TARGET_UNO)
+  {
+    uno_ota_end();
+    return;
+  }
+
+  // Update.end() 會檢查 MD5，不符時放棄映像檔
+  if (!Update.isRunning() || ota_offset != ota_size || !Update.end())
+  {
+    serial_println("OTA verify failed");
+    ota_ack(OTA_STATUS_ERROR);
+    return;
+  }
+
+  ota_ack(OTA_STATUS_DONE);
+  serial_println("OTA done, restarting");
+  serial_tx_drain();
+#ifdef CAPTURE_LINKS
+  capture_flush();
+#endif
+  transport_flush();
+  delay(100);
+  ESP.restart();
+}
+
+void uno_ota_end()
+{
+  uint8_t md5[16];
+  bool verified = false;
+
+  if (ota_file)
+  {
+    ota_file.close();
+    ota_md5_builder.calculate();
+    ota_md5_builder.getBytes(md5);
+    verified = ota_offset == ota_size && memcmp(md5, ota_md5, 16) == 0;
+  }
+
+  if (!verified)
+  {
+    serial_println("OTA verify failed");
+    ota_ack(OTA_STATUS_ERROR);
+    return;
+  }
+
+  serial_println("OTA flashing Uno");
+  if (!uno_flash())
+  {
+    serial_println("OTA Uno flash failed");
+    ota_ack(OTA_STATUS_ERROR);
+    return;
+  }
+
+  serial_println("OTA Uno flashed");
+  ota_ack(OTA_STATUS_DONE);
+}
+
+// 透過 STK500v1 協定燒錄 /uno.bin 到 Uno（optiboot）
+// 燒錄期間 Serial 連到 Uno 的 bootloader，不可以呼叫 serial_println()
+bool uno_flash()
+{
+  Stk500Port port = {uno_port_available, uno_port_read, uno_port_write, uno_port_read_bytes};
+  bool success;
+
+  uno_image = LittleFS.open(UNO_IMAGE_PATH, "r");
+  if (!uno_image)
+  {
+    return false;
+  }
+
+  // 重啟 Uno 進入 bootloader，燒錄期間 serial_println() 的訊息留在佇列裡
+  serial_tx_drain();
+  Serial.flush();
+  Serial.begin(UNO_BOOTLOADER_BAUD);
+  // 接上 Uno D1，收 bootloader 的回應
+  digitalWrite(UNO_RX_ENABLE_PIN, LOW);
+  pinMode(UNO_RX_ENABLE_PIN, OUTPUT);
+  pinMode(UNO_RESET_PIN, OUTPUT);
+  digitalWrite(UNO_RESET_PIN, LOW);
+  delay(UNO_RESET_PULSE_MS);
+  digitalWrite(UNO_RESET_PIN, HIGH);
+  pinMode(UNO_RESET_PIN, INPUT);
+  delay(UNO_BOOTLOADER_START_MS);
+
+  success = stk500_flash(&port, uno_image_read, ota_size);
+
+  uno_image.close();
+  Serial.flush();
+  // 新的程式開始執行前斷開 D1
+  pinMode(UNO_RX_ENABLE_PIN, INPUT_PULLUP);
+  Serial.begin(9600);
+
+  return success;
+}
+
+int uno_port_available()
+{
+  return Serial.available();
+}
+
+int uno_port_read()
+{
+  return Serial.read();
+}
+
+size_t uno_port_write(const uint8_t *data, size_t length)
+{
+  return Serial.write(data, length);
+}
+
+size_t uno_port_read_bytes(uint8_t *buffer, size_t length, unsigned long timeout_ms)
+{
+  Serial.setTimeout(timeout_ms);
+  return Serial.readBytes(buffer, length);
+}
+
+size_t uno_image_read(uint8_t *buffer, size_t size)
+{
+  // 每燒錄一頁讀一次，順便餵 watchdog
+  yield();
+  return uno_image.read(buffer, size);
+}
+
+void ota_ack(uint8_t status)
+{
+  uint8_t payload[PACKET_OTA_ACK_PAYLOAD_SIZE];
+
+  payload[0] = status;
+  memcpy(payload + 1, &ota_offset, 4);
+  tcp_send(OPCODE_CLIENT_OTA_ACK, payload, sizeof(payload));
+}
+
+inline void tcp_send(Packet *packet)
+{
+#ifdef MULTIDROP_BUS
+  // 標示這個封包來自哪個節點
+  tcp_send(OPCODE_NODE_SELECT, &bus_rx_node, 1);
+#endif
+  tcp_send(packet->opcode, packet->payload, packet->payload_size);
+}
+
+void tcp_send(uint8_t opcode, uint8_t *payload, size_t payload_size)
+{
+  PROFILE_BEGIN(PROFILE_STAGE_TCP_WRITE);
+
+  if (payload_size < TCP_TX_BUFFER_SIZE)
+  {
+    // 組成一個完整的封包再寫出，避免 opcode 和 payload 被拆成兩個 TCP segment
+    tcp_tx_buffer[0] = opcode;
+    memcpy(tcp_tx_buffer + 1, payload, payload_size);
+    transport_write(tcp_tx_buffer, payload_size + 1);
+  }
+  else
+  {
+    // payload 太大時直接分段寫出，不另外配置記憶體
+    transport_write(&opcode, 1);
+    transport_write(payload, payload_size);
+  }
+  CAPTURE(CAPTURE_TCP_TX, &opcode, 1);
+  CAPTURE(CAPTURE_TCP_TX, payload, payload_size);
+
+  PROFILE_END(PROFILE_STAGE_TCP_WRITE);
+}
+
+inline void serial_send(Packet *packet)
+{
+#ifdef MULTIDROP_BUS
+  // 轉給 server 指定的節點，只套用在這一個封包
+  uint8_t node = tcp_node;
+  tcp_node = BUS_BROADCAST;
+  if (!bus_begin_frame(node, packet->payload_size))
+  {
+    return;
+  }
+  serial_write(packet->opcode);
+  serial_write(packet->payload, packet->payload_size);
+  serial_write(EOP);
+  bus_end_frame();
+#else
+  serial_send(packet->opcode, packet->payload, packet->payload_size);
+#endif
+}
+
+void serial_send(uint8_t opcode, uint8_t *payload, size_t payload_size)
+{
+#ifdef SERIAL_TX_QUEUES
+  serial_tx_enqueue(serial_tx_priority(opcode), opcode, payload, payload_size);
+#else
+  if (!bus_begin_frame(BUS_BROADCAST, payload_size))
+  {
+    return;
+  }
+  serial_write(opcode);
+  serial_write(payload, payload_size);
+  serial_write(EOP);
+  bus_end_frame();
+#endif
+}
+
+void serial_println(String message)
+{
+#ifdef SERIAL_TX_QUEUES
+  uint8_t payload[SERIAL_LOG_MAX_SIZE + 1];
+  size_t length = message.length();
+
+  if (length > SERIAL_LOG_MAX_SIZE)
+  {
+    length = SERIAL_LOG_MAX_SIZE;
+  }
+  memcpy(payload, message.c_str(), length);
+  payload[length++] = '\n';
+  serial_tx_enqueue(TX_QUEUE_LOG, OPCODE_ESP8266_LOG, payload, length);
+#else
+  // 節點還佔著 bus 時產生的 log 直接丟掉
+  if (!bus_begin_frame(BUS_BROADCAST, message.length() + 1))
+  {
+    return;
+  }
+  serial_write(OPCODE_ESP8266_LOG);
+  serial_write((const uint8_t *)message.c_str(), message.length());
+  serial_write('\n');
+  serial_write(EOP);
+  bus_end_frame();
+#endif
+}
+
+#ifdef SERIAL_TX_QUEUES
+// 排入佇列，log 和遙測放不下就丟掉，控制封包則等佇列送出騰出空間
+bool serial_tx_enqueue(uint8_t priority, uint8_t opcode, const uint8_t *payload, size_t payload_size)
+{
+  TxQueue *queue = &serial_tx_queues[priority];
+  uint16_t frame_size = payload_size + 2;
+  uint16_t enqueued_ms = millis();
+  uint8_t header[TX_FRAME_HEADER_SIZE];
+  uint8_t eop = EOP;
+
+  if (priority == TX_QUEUE_CONTROL && frame_size + TX_FRAME_HEADER_SIZE <= queue->size)
+  {
+    while (queue->size - queue->length < frame_size + TX_FRAME_HEADER_SIZE)
+    {
+      serial_tx_pump();
+      yield();
+    }
+  }
+
+  if (queue->size - queue->length < frame_size + TX_FRAME_HEADER_SIZE)
+  {
+    queue->dropped++;
+    return false;
+  }
+
+  memcpy(header, &frame_size, 2);
+  memcpy(header + 2, &enqueued_ms, 2);
+  tx_queue_push(queue, header, sizeof(header));
+  tx_queue_push(queue, &opcode, 1);
+  tx_queue_push(queue, payload, payload_size);
+  tx_queue_push(queue, &eop, 1);
+  if (queue->length > queue->max_depth)
+  {
+    queue->max_depth = queue->length;
+  }
+
+  return true;
+}
+
+uint8_t serial_tx_priority(uint8_t opcode)
+{
+  switch (opcode)
+  {
+  case OPCODE_ESP8266_TIME:
+    return TX_QUEUE_TELEMETRY;
+  case OPCODE_ESP8266_LOG:
+    return TX_QUEUE_LOG;
+  default:
+    // server 轉來的設定和指令、SLEEP/AWAKE
+    return TX_QUEUE_CONTROL;
+  }
+}
+
+void tx_queue_push(TxQueue *queue, const uint8_t *data, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    queue->buffer[(queue->head + queue->length) % queue->size] = data[i];
+    queue->length++;
+  }
+}
+
+uint8_t tx_queue_pop(TxQueue *queue)
+{
+  uint8_t data = queue->buffer[queue->head];
+
+  queue->head = (queue->head + 1) % queue->size;
+  queue->length--;
+
+  return data;
+}
+
+bool serial_tx_pending()
+{
+  for (auto &queue : serial_tx_queues)
+  {
+    if (queue.length)
+    {
+      return true;
+    }
+  }
+
+  return serial_tx_remaining > 0;
+}
+
+// 新排入 priority 佇列的封包前面還有多少 byte 要送（含佇列中的封包標頭，略為高估）
+size_t serial_tx_backlog(uint8_t priority)
+{
+  size_t backlog = serial_tx_remaining + SERIAL_TX_FIFO_SIZE - Serial.availableForWrite();
+
+  for (uint8_t i = 0; i <= priority; i++)
+  {
+    backlog += serial_tx_queues[i].length;
+  }
+
+  return backlog;
+}
+
+// 把 UART FIFO 補到 SERIAL_TX_FIFO_LIMIT，不會等待
+void serial_tx_pump()
+{
+  int room = Serial.availableForWrite() - (SERIAL_TX_FIFO_SIZE - SERIAL_TX_FIFO_LIMIT);
+
+  while (room > 0)
+  {
+    if (serial_tx_remaining == 0)
+    {
+      // 上一個封包送完了，從優先順序最高的佇列取下一個
+      serial_tx_current = NULL;
+      for (auto &queue : serial_tx_queues)
+      {
+        if (queue.length)
+        {
+          serial_tx_current = &queue;
+          break;
+        }
+      }
+      if (!serial_tx_current)
+      {
         break;
+      }
+
+      serial_tx_remaining = tx_queue_pop(serial_tx_current);
+      serial_tx_remaining |= tx_queue_pop(serial_tx_current) << 8;
+      uint16_t enqueued_ms = tx_queue_pop(serial_tx_current);
+      enqueued_ms |= tx_queue_pop(serial_tx_current) << 8;
+      uint16_t wait_ms = (uint16_t)millis() - enqueued_ms;
+      if (wait_ms > serial_tx_current->max_wait_ms)
+      {
+        serial_tx_current->max_wait_ms = wait_ms;
+      }
+    }
+
+    // 一次寫出佇列中連續的一段
+    TxQueue *queue = serial_tx_current;
+    size_t length = serial_tx_remaining;
+    if (length > (size_t)room)
+    {
+      length = room;
+    }
+    if (length > (size_t)(queue->size - queue->head))
+    {
+      length = queue->size - queue->head;
+    }
+    serial_write(queue->buffer + queue->head, length);
+    queue->head = (queue->head + length) % queue->size;
+    queue->length -= length;
+    serial_tx_remaining -= length;
+    room -= length;
+  }
+}
+#endif
+
+// 把佇列全部寫進 UART，在 Serial.flush()、改 baud rate 或重開機之前呼叫
+void serial_tx_drain()
+{
+#ifdef SERIAL_TX_QUEUES
+  while (serial_tx_pending())
+  {
+    serial_tx_pump();
+    yield();
+  }
+#endif
+}
+
+void serial_write(const uint8_t *data, size_t length)
+{
+  Serial.write(data, length);
+  CAPTURE(CAPTURE_SERIAL_TX, data, length);
+}
+
+void serial_write(uint8_t data)
+{
+  serial_write(&data, 1);
+}
+
+#ifdef MULTIDROP_BUS
+// 節點還在回覆 poll 時不能送資料，邊等邊處理收到的封包
+void bus_wait_idle()
+{
+  bus_waiting = true;
+  while (bus_polling && millis() - bus_poll_ms < BUS_POLL_TIMEOUT_MS)
+  {
+    while (Serial.available())
+    {
+      bus_packet_handler((uint8_t)Serial.read());
+    }
+    yield();
+  }
+  bus_waiting = false;
+  bus_poll_done();
+}
+
+// 不能送出時（在 bus_wait_idle() 裡處理封包時產生的 log 等）回傳 false，呼叫端直接丟掉這個封包
+bool bus_begin_frame(uint8_t node, size_t payload_size)
+{
+  if (bus_waiting)
+  {
+    return false;
+  }
+
+  bus_wait_idle();
+  digitalWrite(BUS_DE_PIN, HIGH);
+  serial_write(node);
+  serial_write((uint8_t)payload_size);
+  return true;
+}
+
+void bus_end_frame()
+{
+  // 等資料送完才能放開 bus
+  Serial.flush();
+  digitalWrite(BUS_DE_PIN, LOW);
+}
+
+// 節點回完 POLL_END 或逾時。逾時的節點可能停在 frame 中間（重啟或被切斷），
+// 丟掉收到一半的 frame，下一個 byte 當作新 frame 的位址
+void bus_poll_done()
+{
+  if (bus_polling)
+  {
+    bus_polling = false;
+    bus_rx_state = BUS_RX_ADDRESS;
+    bus_rx_remaining = 0;
+    reset_packet(&serial_packet);
+  }
+}
+
+void bus_poll()
+{
+  uint8_t node = bus_nodes[bus_poll_index];
+
+  bus_poll_index = (bus_poll_index + 1) % sizeof(bus_nodes);
+  if (!bus_begin_frame(node, 0))
+  {
+    return;
+  }
+  // 每次 poll 都從 frame 開頭開始解析
+  bus_rx_state = BUS_RX_ADDRESS;
+  bus_rx_remaining = 0;
+  reset_packet(&serial_packet);
+  serial_write(OPCODE_BUS_POLL);
+  serial_write(EOP);
+  bus_end_frame();
+  bus_polling = true;
+  bus_poll_ms = millis();
+}
+
+// 拆掉 [節點位址][payload 長度]，其餘交給 serial_packet_handler
+void bus_packet_handler(uint8_t incoming)
+{
+  switch (bus_rx_state)
+  {
+  case BUS_RX_ADDRESS:
+    bus_rx_node = incoming;
+    bus_rx_state = BUS_RX_LENGTH;
+    break;
+
+  case BUS_RX_LENGTH:
+    // opcode + payload + EOP
+    bus_rx_remaining = incoming + 2;
+    bus_rx_state = BUS_RX_FRAME;
+    break;
+
+  default:
+    serial_packet_handler(incoming);
+    if (--bus_rx_remaining == 0)
+    {
+      bus_rx_state = BUS_RX_ADDRESS;
+    }
+    break;
+  }
+}
+#endif
 
-      case OPCODE_CLIENT_GET_SERVER_CONFIG:
-        if (incoming == EOP)
+void serial_packet_handler(uint8_t incoming)
+{
+  if (serial_packet.opcode == OPCODE_EMPTY)
+  {
+    serial_packet.opcode = incoming;
+  }
+  else
+  {
+    switch (serial_packet.opcode)
+    {
+    case OPCODE_SUBMIT_M:
+      if (serial_packet.payload_size == 0)
+      {
+        push_packet_payload(&serial_packet, incoming);
+        break;
+      }
+      if (incoming == EOP)
+      {
+        if (serial_packet.payload_size == 1)
         {
+#ifdef LOW_POWER_MODE
+          if (!tcp_connected)
+          {
+            // 連上 server 之後再送出
+            rtc_push_sample(serial_packet.payload[0]);
+            reset_packet(&serial_packet);
+            break;
+          }
+#endif
           // 轉發封包
           tcp_send(&serial_packet);
         }
-        reset_packet(&serial_packet);
+      }
+      reset_packet(&serial_packet);
+      break;
+
+    case OPCODE_CLIENT_SUBMIT_CONFIG:
+      if (serial_packet.payload_size < PACKET_CONFIG_PAYLOAD_SIZE)
+      {
+        push_packet_payload(&serial_packet, incoming);
+        break;
+      }
+      if (incoming == EOP)
+      {
+        // 轉發封包
+        tcp_send(&serial_packet);
+      }
+      reset_packet(&serial_packet);
+      break;
+
+    case OPCODE_CLIENT_SUBMIT_HEALTH:
+    case OPCODE_CLIENT_SUBMIT_PROFILE:
+    case OPCODE_CLIENT_SUBMIT_PUMP_MODEL:
+    case OPCODE_CLIENT_SUBMIT_PROBE_ALERT:
+    case OPCODE_SUBMIT_M_AT:
+    case OPCODE_CLIENT_SUBMIT_QUEUE_STATS:
+      // 固定長度的封包，payload 裡可能有 0x00，只能靠長度判斷結尾
+      if (serial_packet.payload_size < serial_payload_size(serial_packet.opcode))
+      {
+        push_packet_payload(&serial_packet, incoming);
         break;
+      }
+      if (incoming == EOP)
+      {
+#ifdef LOW_POWER_MODE
+        if (!tcp_connected && serial_packet.opcode == OPCODE_SUBMIT_M_AT)
+        {
+          // RTC memory 只放得下 M，時間由 server 在收到時補上
+          rtc_push_sample(serial_packet.payload[0]);
+          reset_packet(&serial_packet);
+          break;
+        }
+#endif
+        // 轉發封包
+        tcp_send(&serial_packet);
+      }
+      reset_packet(&serial_packet);
+      break;
+
+#ifdef MULTIDROP_BUS
+    case OPCODE_BUS_POLL_END:
+      if (incoming == EOP)
+      {
+        bus_polling = false;
+      }
+      reset_packet(&serial_packet);
+      break;
+#endif
+
+    case OPCODE_CLIENT_GET_SERVER_CONFIG:
+      if (incoming == EOP)
+      {
+        // 轉發封包
+        tcp_send(&serial_packet);
+      }
+      reset_packet(&serial_packet);
+      break;
+
+    default:
+      serial_println("unknown opcode");
+      reset_packet(&serial_packet);
+      break;
+    }
+  }
+}
+
+size_t serial_payload_size(uint8_t opcode)
+{
+  switch (opcode)
+  {
+  case OPCODE_CLIENT_SUBMIT_HEALTH:
+    return PACKET_HEALTH_PAYLOAD_SIZE;
+  case OPCODE_CLIENT_SUBMIT_PROFILE:
+    return PACKET_PROFILE_PAYLOAD_SIZE;
+  case OPCODE_CLIENT_SUBMIT_PUMP_MODEL:
+    return PACKET_PUMP_MODEL_PAYLOAD_SIZE;
+  case OPCODE_CLIENT_SUBMIT_PROBE_ALERT:
+    return PACKET_PROBE_ALERT_PAYLOAD_SIZE;
+  case OPCODE_SUBMIT_M_AT:
+    return PACKET_M_AT_PAYLOAD_SIZE;
+  case OPCODE_CLIENT_SUBMIT_QUEUE_STATS:
+    return PACKET_CLIENT_QUEUE_STATS_PAYLOAD_SIZE;
+  default:
+    return 0;
+  }
+}
+
+void reset_packet(Packet *packet)
+{
+  packet->opcode = OPCODE_EMPTY;
+  packet->payload_size = (size_t)0;
+}
+
+bool push_packet_payload(Packet *packet, uint8_t data)
+{
+  if (packet->payload_size >= PACKET_MAX_PAYLOAD_SIZE)
+  {
+    // payload overflow, drop the packet
+    reset_packet(packet);
+    return false;
+  }
+
+  packet->payload[packet->payload_size++] = data;
+
+  return true;
+}
+
+#ifdef CLOCK_SYNC
+int64_t clock_epoch_ms(uint32_t ms)
+{
+  return clock_ref_epoch_ms + (int64_t)((int32_t)(ms - clock_ref_ms) * (1 + clock_drift));
+}
+
+void clock_ping()
+{
+  uint8_t payload[PACKET_TIME_PING_PAYLOAD_SIZE];
+  uint32_t t1 = millis();
+
+  memcpy(payload, &t1, 4);
+  memcpy(payload + 4, &clock_last_rtt_ms, 2);
+  tcp_send(OPCODE_TIME_PING, payload, sizeof(payload));
+}
+
+// t1、t4 是 ESP8266 送出 TIME_PING 和收到 TIME_PONG 的 millis，t2、t3 是 server 的 epoch ms
+void clock_sample(uint8_t *payload, uint32_t t4)
+{
+  uint32_t t1;
+  int64_t t2, t3;
+
+  memcpy(&t1, payload, 4);
+  memcpy(&t2, payload + 4, 8);
+  memcpy(&t3, payload + 12, 8);
+
+  int64_t rtt = (int64_t)(t4 - t1) - (t3 - t2);
+  if (rtt < 0 || rtt > CLOCK_MAX_RTT_MS)
+  {
+    return;
+  }
+  clock_last_rtt_ms = rtt;
+
+  // 最小 RTT 慢慢放寬，網路路徑改變之後才不會一直拒絕樣本
+  if (clock_min_rtt_ms < UINT16_MAX)
+  {
+    clock_min_rtt_ms++;
+  }
+  if (rtt < clock_min_rtt_ms)
+  {
+    clock_min_rtt_ms = rtt;
+  }
+  // 排隊延遲大的樣本 offset 誤差也大
+  if (clock_synced && rtt > clock_min_rtt_ms * 2 + CLOCK_RTT_SLACK_MS)
+  {
+    return;
+  }
+
+  // 假設去程和回程的延遲相同
+  int64_t epoch_ms = t3 + rtt / 2;
+  int64_t error = clock_synced ? epoch_ms - clock_epoch_ms(t4) : 0;
+
+  if (!clock_synced || error > CLOCK_STEP_MS || error < -CLOCK_STEP_MS)
+  {
+    clock_ref_ms = t4;
+    clock_ref_epoch_ms = epoch_ms;
+    clock_drift = 0;
+    clock_drift_ref_ms = t4;
+    clock_drift_ref_epoch_ms = epoch_ms;
+    clock_synced = true;
+    clock_stepped = true;
+    serial_println("clock synced");
+    return;
+  }
+
+  clock_ref_epoch_ms = clock_epoch_ms(t4) + error / CLOCK_SLEW_DIVISOR;
+  clock_ref_ms = t4;
+
+  if (t4 - clock_drift_ref_ms >= CLOCK_DRIFT_SPAN_MS)
+  {
+    float drift = (float)(clock_ref_epoch_ms - clock_drift_ref_epoch_ms) / (t4 - clock_drift_ref_ms) - 1;
+    drift = constrain(drift, -CLOCK_MAX_DRIFT, CLOCK_MAX_DRIFT);
+    clock_drift += (drift - clock_drift) / 2;
+    clock_drift_ref_ms = t4;
+    clock_drift_ref_epoch_ms = clock_ref_epoch_ms;
+  }
+}
+
+void clock_send_serial()
+{
+  uint8_t payload[PACKET_TIME_PAYLOAD_SIZE];
+  int64_t epoch_ms = clock_epoch_ms(millis()) + CLOCK_SERIAL_LATENCY_MS;
+#ifdef SERIAL_TX_QUEUES
+  // 還要等前面的資料送完
+  epoch_ms += serial_tx_backlog(TX_QUEUE_TELEMETRY) * SERIAL_BYTE_US / 1000;
+#endif
+  uint32_t epoch_s = epoch_ms / 1000;
+  uint16_t epoch_frac_ms = epoch_ms % 1000;
 
-      default:
-        serial_println("unknown opcode");
-        reset_packet(&serial_packet);
+  memcpy(payload, &epoch_s, 4);
+  memcpy(payload + 4, &epoch_frac_ms, 2);
+  serial_send(OPCODE_ESP8266_TIME, payload, sizeof(payload));
+  clock_stepped = false;
+}
+#endif
+
+#ifdef CAPTURE_LINKS
+// 開機時把上次的記錄改名保留，開一個新的檔案
+void capture_open()
+{
+  uint8_t header[5] = {'C', 'O', '3', 'C', CAPTURE_VERSION};
+
+  if (capture_file)
+  {
+    capture_file.close();
+  }
+  LittleFS.remove(CAPTURE_OLD_PATH);
+  LittleFS.rename(CAPTURE_PATH, CAPTURE_OLD_PATH);
+  capture_file = LittleFS.open(CAPTURE_PATH, "w");
+  if (capture_file)
+  {
+    capture_file.write(header, sizeof(header));
+  }
+}
+
+void capture_write(uint8_t link, const uint8_t *data, size_t length)
+{
+  uint32_t now = millis();
+  uint16_t record_length;
+  size_t size;
+
+  // OTA 的映像檔不記錄，避免塞滿 LittleFS
+  if (capture_paused || capture_full || ota_running())
+  {
+    return;
+  }
+
+  do
+  {
+    if (capture_record != SIZE_MAX && capture_record_link == link && capture_record_ms == now)
+    {
+      // 併入上一筆記錄
+      memcpy(&record_length, capture_buffer + capture_record + 5, 2);
+      size = min(length, min((size_t)(UINT16_MAX - record_length), CAPTURE_BUFFER_SIZE - capture_length));
+      memcpy(capture_buffer + capture_length, data, size);
+      capture_length += size;
+      record_length += size;
+      memcpy(capture_buffer + capture_record + 5, &record_length, 2);
+      data += size;
+      length -= size;
+      if (length == 0)
+      {
         break;
       }
     }
+
+    if (CAPTURE_BUFFER_SIZE - capture_length <= CAPTURE_RECORD_HEADER_SIZE)
+    {
+      capture_flush();
+      if (capture_full)
+      {
+        return;
+      }
+    }
+
+    // 開始新的一筆記錄
+    capture_record = capture_length;
+    capture_record_link = link;
+    capture_record_ms = now;
+    record_length = 0;
+    memcpy(capture_buffer + capture_length, &now, 4);
+    capture_buffer[capture_length + 4] = link;
+    memcpy(capture_buffer + capture_length + 5, &record_length, 2);
+    capture_length += CAPTURE_RECORD_HEADER_SIZE;
+  } while (length > 0);
+}
+
+void capture_flush()
+{
+  capture_record = SIZE_MAX;
+  if (capture_length == 0)
+  {
+    return;
+  }
+  if (capture_file && capture_file.size() + capture_length > CAPTURE_MAX_FILE_SIZE)
+  {
+    capture_full = true;
+    serial_println("capture full");
+  }
+  else if (capture_file)
+  {
+    capture_file.write(capture_buffer, capture_length);
+    capture_file.flush();
+  }
+  capture_length = 0;
+}
+
+// 分段送出記錄檔，最後送出 length 為 0 的 CAPTURE
+void tcp_send_capture(uint8_t file)
+{
+  uint8_t payload[PACKET_CAPTURE_HEADER_SIZE + CAPTURE_CHUNK_SIZE];
+  uint32_t offset = 0;
+  uint16_t length = 0;
+
+  capture_flush();
+  capture_paused = true;
+  capture_file.close();
+
+  File capture = LittleFS.open(file ? CAPTURE_OLD_PATH : CAPTURE_PATH, "r");
+  do
+  {
+    length = capture ? capture.read(payload + PACKET_CAPTURE_HEADER_SIZE, CAPTURE_CHUNK_SIZE) : 0;
+    memcpy(payload, &offset, 4);
+    memcpy(payload + 4, &length, 2);
+    tcp_send(OPCODE_ESP8266_CAPTURE, payload, PACKET_CAPTURE_HEADER_SIZE + length);
+    offset += length;
+  } while (length > 0 && tcp_connected);
+  if (capture)
+  {
+    capture.close();
+  }
+
+  capture_file = LittleFS.open(CAPTURE_PATH, "a");
+  capture_paused = false;
+}
+#endif
+
+void setup()
+{
+  Serial.begin(9600);
+#ifdef MULTIDROP_BUS
+  pinMode(BUS_DE_PIN, OUTPUT);
+  digitalWrite(BUS_DE_PIN, LOW);
+#endif
+#ifdef LOW_POWER_MODE
+  // 盡早通知 arduino_controller 可以開始送資料
+  serial_send(OPCODE_ESP8266_AWAKE, NULL, 0);
+  serial_tx_drain();
+  rtc_load();
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+#endif
+  LittleFS.begin();
+#ifdef CAPTURE_LINKS
+  capture_open();
+#endif
+  maintain_wifi();
+  serial_println("setup done");
+}
+
+void loop()
+{
+  static unsigned long last_tcp_ping_ms = 0;
+  static unsigned long last_tcp_health_ms = 0;
+  static unsigned long last_endpoint_probe_ms = 0;
+#ifdef CLOCK_SYNC
+  static unsigned long last_clock_serial_ms = 0;
+#endif
+#ifdef LOW_POWER_MODE
+  static unsigned long last_activity_ms = 0;
+#endif
+  static unsigned long current_ms = 0;
+  static uint32_t free_heap = 0;
+
+  PROFILE_BEGIN(PROFILE_STAGE_LOOP);
+
+  current_ms = millis();
+
+  free_heap = ESP.getFreeHeap();
+  if (free_heap < min_free_heap)
+  {
+    min_free_heap = free_heap;
+  }
+
+  if (WiFi.status() != WL_CONNECTED)
+  {
+    maintain_wifi();
+  }
+
+  if (!tcp_connecting && !tcp_connected)
+  {
+    maintain_tcp();
+  }
+  // 連線可能花了好幾秒，tcp_last_received_ms 比 current_ms 新，要重新取得時間
+  current_ms = millis();
+
+  // heartbeat
+  if (tcp_connected)
+  {
+    if (current_ms - last_tcp_ping_ms >= TCP_PING_INTERVAL_MS)
+    {
+      serial_println("TCP ping");
+#ifdef CLOCK_SYNC
+      clock_ping();
+#else
+      tcp_send(OPCODE_PING, NULL, 0);
+#endif
+      // 立即送出，RTT 不包含 WebSocket 的批次等待時間；每次 PING 都重新計時
+      transport_flush();
+      last_tcp_ping_ms = current_ms;
+      tcp_ping_pending = true;
+      tcp_ping_sent_ms = current_ms;
+    }
+
+    if (current_ms - last_tcp_health_ms >= TCP_HEALTH_INTERVAL_MS)
+    {
+      tcp_send_health();
+#ifdef SERIAL_TX_QUEUES
+      tcp_send_queue_stats();
+#endif
+      last_tcp_health_ms = current_ms;
+    }
+
+    if (current_ms - tcp_last_received_ms >= TCP_PONG_TIMEOUT_MS)
+    {
+      // 換一個 server 重新連線
+      endpoint_failed(endpoint_list[endpoint_index]);
+      tcp_close();
+    }
+    else if (current_ms - last_endpoint_probe_ms >= ENDPOINT_PROBE_INTERVAL_MS && !ota_running())
+    {
+      probe_endpoint();
+      last_endpoint_probe_ms = current_ms;
+    }
+  }
+
+  if (tcp_connected && transport_available())
+  {
+    PROFILE_BEGIN(PROFILE_STAGE_TCP_READ);
+    tcp_last_received_ms = current_ms;
+#ifdef LOW_POWER_MODE
+    last_activity_ms = current_ms;
+#endif
+    // read packet
+    do
+    {
+      // 一次讀出一段資料，再逐 byte 交給封包解析
+      size_t rx_length = transport_read(tcp_rx_buffer, sizeof(tcp_rx_buffer));
+      CAPTURE(CAPTURE_TCP_RX, tcp_rx_buffer, rx_length);
+      for (size_t i = 0; i < rx_length && tcp_connected; i++)
+      {
+        tcp_packet_handler(tcp_rx_buffer[i]);
+      }
+    } while (tcp_connected && transport_available());
+    PROFILE_END(PROFILE_STAGE_TCP_READ);
+  }
+
+  // server 關閉連線時 transport 已經停止，這裡也要當作斷線處理
+  if (tcp_connected && !transport_connected())
+  {
+    tcp_close();
+  }
+
+  if (Serial.available())
+  {
+    PROFILE_BEGIN(PROFILE_STAGE_SERIAL_READ);
+#ifdef LOW_POWER_MODE
+    last_activity_ms = current_ms;
+#endif
+    // 一次處理完所有已收到的 byte，避免每輪 loop 只讀一個 byte
+    while (Serial.available())
+    {
+      uint8_t incoming = (uint8_t)Serial.read();
+      CAPTURE(CAPTURE_SERIAL_RX, &incoming, 1);
+#ifdef MULTIDROP_BUS
+      bus_packet_handler(incoming);
+#else
+      serial_packet_handler(incoming);
+#endif
+    }
+    PROFILE_END(PROFILE_STAGE_SERIAL_READ);
+  }
+
+#ifdef CLOCK_SYNC
+  if (clock_synced && (clock_stepped || current_ms - last_clock_serial_ms >= CLOCK_SERIAL_INTERVAL_MS))
+  {
+    clock_send_serial();
+    last_clock_serial_ms = current_ms;
+  }
+#endif
+
+#ifdef SERIAL_TX_QUEUES
+  serial_tx_pump();
+#endif
+
+#ifdef MULTIDROP_BUS
+  // 輪流 poll 每個節點，逾時的節點直接跳過
+  if (bus_polling && current_ms - bus_poll_ms >= BUS_POLL_TIMEOUT_MS)
+  {
+    bus_poll_done();
+  }
+  if (!bus_polling && current_ms - bus_poll_ms >= BUS_POLL_INTERVAL_MS)
+  {
+    bus_poll();
+  }
+#endif
+
+  if (tcp_connected)
+  {
+    transport_loop();
+  }
+
+#ifdef LOW_POWER_MODE
+  // 閒置一段時間，或一直連不上 server，就進入 deep sleep
+  if (current_ms - last_activity_ms >= LOW_POWER_IDLE_MS &&
+      (tcp_connected || current_ms >= LOW_POWER_MAX_AWAKE_MS) &&
+      !ota_running())
+  {
+    if (!enter_deep_sleep())
+    {
+      last_activity_ms = current_ms;
+    }
   }
+#endif
+
+  PROFILE_END(PROFILE_STAGE_LOOP);
 
   delay(1);
 }
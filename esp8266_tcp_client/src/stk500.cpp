@@ -0,0 +1,90 @@
+#include <string.h>
+
+#include "stk500.h"
+
+bool stk500_command(Stk500Port *port, uint8_t *command, size_t command_size, uint8_t *data, size_t data_size, uint8_t *response, size_t response_size)
+{
+  uint8_t status = STK_CRC_EOP;
+
+  // 丟掉上一個命令逾時後才到的回應
+  while (port->available())
+  {
+    port->read();
+  }
+
+  port->write(command, command_size);
+  if (data_size)
+  {
+    port->write(data, data_size);
+  }
+  port->write(&status, 1);
+
+  if (port->read_bytes(&status, 1, STK500_TIMEOUT_MS) != 1 || status != STK_INSYNC)
+  {
+    return false;
+  }
+  if (response_size && port->read_bytes(response, response_size, STK500_TIMEOUT_MS) != response_size)
+  {
+    return false;
+  }
+
+  return port->read_bytes(&status, 1, STK500_TIMEOUT_MS) == 1 && status == STK_OK;
+}
+
+bool stk500_flash(Stk500Port *port, size_t (*read_image)(uint8_t *buffer, size_t size), uint32_t image_size)
+{
+  uint8_t page[STK500_PAGE_SIZE];
+  uint8_t readback[STK500_PAGE_SIZE];
+  uint8_t command[4];
+  bool success = false;
+
+  for (int i = 0; i < STK500_SYNC_RETRY; i++)
+  {
+    command[0] = STK_GET_SYNC;
+    if ((success = stk500_command(port, command, 1, NULL, 0, NULL, 0)))
+    {
+      break;
+    }
+  }
+
+  command[0] = STK_ENTER_PROGMODE;
+  success = success && stk500_command(port, command, 1, NULL, 0, NULL, 0);
+
+  for (uint32_t address = 0; success && address < image_size; address += STK500_PAGE_SIZE)
+  {
+    size_t length = read_image(page, STK500_PAGE_SIZE);
+    // 最後一頁不足的部分補 0xFF（flash 抹除後的值）
+    memset(page + length, 0xFF, STK500_PAGE_SIZE - length);
+
+    // 位址以 word 為單位
+    command[0] = STK_LOAD_ADDRESS;
+    command[1] = (address >> 1) & 0xFF;
+    command[2] = (address >> 9) & 0xFF;
+    success = stk500_command(port, command, 3, NULL, 0, NULL, 0);
+
+    command[0] = STK_PROG_PAGE;
+    command[1] = STK500_PAGE_SIZE >> 8;
+    command[2] = STK500_PAGE_SIZE & 0xFF;
+    command[3] = 'F';
+    success = success && stk500_command(port, command, 4, page, STK500_PAGE_SIZE, NULL, 0);
+
+    // 讀回來比對
+    command[0] = STK_LOAD_ADDRESS;
+    command[1] = (address >> 1) & 0xFF;
+    command[2] = (address >> 9) & 0xFF;
+    success = success && stk500_command(port, command, 3, NULL, 0, NULL, 0);
+
+    command[0] = STK_READ_PAGE;
+    command[1] = STK500_PAGE_SIZE >> 8;
+    command[2] = STK500_PAGE_SIZE & 0xFF;
+    command[3] = 'F';
+    success = success && stk500_command(port, command, 4, NULL, 0, readback, STK500_PAGE_SIZE);
+    success = success && memcmp(page, readback, STK500_PAGE_SIZE) == 0;
+  }
+
+  // 離開燒錄模式後 optiboot 會跳到新的程式
+  command[0] = STK_LEAVE_PROGMODE;
+  stk500_command(port, command, 1, NULL, 0, NULL, 0);
+
+  return success;
+}
@@ -0,0 +1,60 @@
+#ifndef TRANSPORT_WS
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiClient.h>
+
+#include "transport.h"
+
+#define TCP_READ_TIMEOUT_MS 10000
+
+WiFiClient tcp_client;
+
+bool transport_connect(const char *host, uint16_t port, const String &headers)
+{
+  if (!tcp_client.connect(host, port))
+  {
+    return false;
+  }
+
+  tcp_client.setNoDelay(true);
+  tcp_client.setTimeout(TCP_READ_TIMEOUT_MS);
+  tcp_client.print(headers);
+  return true;
+}
+
+void transport_stop()
+{
+  tcp_client.stop();
+}
+
+bool transport_connected()
+{
+  return tcp_client.connected();
+}
+
+int transport_available()
+{
+  return tcp_client.available();
+}
+
+size_t transport_read(uint8_t *buffer, size_t size)
+{
+  return tcp_client.read(buffer, size);
+}
+
+size_t transport_write(const uint8_t *buffer, size_t size)
+{
+  return tcp_client.write(buffer, size);
+}
+
+void transport_flush()
+{
+  tcp_client.flush();
+}
+
+void transport_loop()
+{
+}
+
+#endif
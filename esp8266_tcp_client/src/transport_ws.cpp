@@ -0,0 +1,342 @@
+#ifdef TRANSPORT_WS
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiClientSecureBearSSL.h>
+#include <base64.h>
+
+#include "transport.h"
+
+#define WS_URL "/jet/ncu/CO3006/conn"
+#define WS_HANDSHAKE_TIMEOUT_MS 10000
+
+// 每個 frame 前面預留的空間：2 bytes 標頭 + 8 bytes 延伸長度 + 4 bytes mask，
+// frame header 直接寫在 payload 前面，不需要搬移 payload
+#define WS_HEADROOM 14
+// 多個封包合併成一個 binary message 的大小上限和最長等待時間
+#define WS_BATCH_SIZE 512
+#define WS_BATCH_DELAY_MS 20
+#define WS_CONTROL_PAYLOAD_SIZE 125
+
+#define WS_OPCODE_BINARY (uint8_t)0x2
+#define WS_OPCODE_CLOSE (uint8_t)0x8
+#define WS_OPCODE_PING (uint8_t)0x9
+#define WS_OPCODE_PONG (uint8_t)0xA
+
+#define WS_RX_HEADER 0
+#define WS_RX_LENGTH 1
+#define WS_RX_EXTENDED_LENGTH 2
+#define WS_RX_PAYLOAD 3
+#define WS_RX_CONTROL 4
+
+// SHA-1 fingerprint of the server certificate
+const char ws_fingerprint[] PROGMEM = "14:8B:4B:5E:BE:0E:B7:1F:6E:B6:3A:23:D9:F1:82:1C:84:98:3F:BB";
+
+BearSSL::WiFiClientSecure ws_client;
+// TLS session 快取，重新連線時以 session ID/ticket 恢復，不必再做完整的 handshake
+BearSSL::Session ws_session;
+bool ws_connected = false;
+
+uint8_t ws_tx_buffer[WS_HEADROOM + WS_BATCH_SIZE];
+size_t ws_tx_length = 0;
+unsigned long ws_tx_first_ms = 0;
+uint8_t ws_control_buffer[WS_HEADROOM + WS_CONTROL_PAYLOAD_SIZE];
+
+uint8_t ws_rx_state = WS_RX_HEADER;
+uint8_t ws_rx_opcode = 0;
+uint8_t ws_rx_length_bytes = 0;
+uint64_t ws_rx_remaining = 0;
+size_t ws_rx_control_length = 0;
+
+void ws_send_frame(uint8_t opcode, uint8_t *payload, size_t length);
+void ws_begin_payload();
+void ws_control_handler();
+bool ws_handshake(const char *host, const String &headers);
+
+// payload 前面必須有 WS_HEADROOM bytes 可以寫入 frame header
+void ws_send_frame(uint8_t opcode, uint8_t *payload, size_t length)
+{
+  size_t header_size = 2 + 4;
+  uint8_t *header;
+  uint8_t *mask = payload - 4;
+  uint32_t mask_key = RANDOM_REG32;
+
+  if (length > 0xFFFF)
+  {
+    header_size += 8;
+  }
+  else if (length > 125)
+  {
+    header_size += 2;
+  }
+
+  header = payload - header_size;
+  header[0] = 0x80 | opcode;
+  if (length > 0xFFFF)
+  {
+    header[1] = 0x80 | 127;
+    for (int i = 0; i < 8; i++)
+    {
+      header[2 + i] = (uint64_t)length >> (56 - 8 * i);
+    }
+  }
+  else if (length > 125)
+  {
+    header[1] = 0x80 | 126;
+    header[2] = length >> 8;
+    header[3] = length & 0xFF;
+  }
+  else
+  {
+    header[1] = 0x80 | length;
+  }
+
+  // client 送出的 frame 必須 mask，直接在原地做 XOR
+  memcpy(mask, &mask_key, 4);
+  for (size_t i = 0; i < length; i++)
+  {
+    payload[i] ^= mask[i & 3];
+  }
+
+  ws_client.write(header, header_size + length);
+}
+
+void ws_begin_payload()
+{
+  if (ws_rx_opcode & 0x08)
+  {
+    // control frame 的 payload 不會超過 125 bytes
+    if (ws_rx_remaining > WS_CONTROL_PAYLOAD_SIZE)
+    {
+      transport_stop();
+      return;
+    }
+    ws_rx_control_length = 0;
+    ws_rx_state = WS_RX_CONTROL;
+    if (ws_rx_remaining == 0)
+    {
+      ws_control_handler();
+    }
+    return;
+  }
+
+  ws_rx_state = ws_rx_remaining ? WS_RX_PAYLOAD : WS_RX_HEADER;
+}
+
+void ws_control_handler()
+{
+  uint8_t *payload = ws_control_buffer + WS_HEADROOM;
+
+  ws_rx_state = WS_RX_HEADER;
+
+  switch (ws_rx_opcode)
+  {
+  case WS_OPCODE_PING:
+    ws_send_frame(WS_OPCODE_PONG, payload, ws_rx_control_length);
+    break;
+
+  case WS_OPCODE_CLOSE:
+    ws_send_frame(WS_OPCODE_CLOSE, payload, 0);
+    transport_stop();
+    break;
+
+  default:
+    break;
+  }
+}
+
+bool ws_handshake(const char *host, const String &headers)
+{
+  uint8_t key[16];
+  String request;
+  String line;
+
+  for (int i = 0; i < 16; i += 4)
+  {
+    uint32_t random_value = RANDOM_REG32;
+    memcpy(key + i, &random_value, 4);
+  }
+
+  request = "GET " WS_URL " HTTP/1.1\r\nHost: ";
+  request += host;
+  request += "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: ";
+  request += base64::encode(key, sizeof(key), false);
+  request += "\r\n";
+  request += headers;
+  request += "\r\n\r\n";
+  ws_client.print(request);
+
+  ws_client.setTimeout(WS_HANDSHAKE_TIMEOUT_MS);
+  line = ws_client.readStringUntil('\n');
+  if (line.indexOf(" 101 ") < 0)
+  {
+    return false;
+  }
+
+  // 略過其餘的 response header
+  do
+  {
+    line = ws_client.readStringUntil('\n');
+  } while (line.length() > 1);
+
+  return true;
+}
+
+bool transport_connect(const char *host, uint16_t port, const String &headers)
+{
+  ws_client.setFingerprint(ws_fingerprint);
+  ws_client.setSession(&ws_session);
+
+  if (!ws_client.connect(host, port))
+  {
+    return false;
+  }
+
+  if (!ws_handshake(host, headers))
+  {
+    ws_client.stop();
+    return false;
+  }
+
+  ws_tx_length = 0;
+  ws_rx_state = WS_RX_HEADER;
+  ws_connected = true;
+  return true;
+}
+
+void transport_stop()
+{
+  ws_client.stop();
+  ws_connected = false;
+  ws_tx_length = 0;
+}
+
+bool transport_connected()
+{
+  return ws_connected && ws_client.connected();
+}
+
+int transport_available()
+{
+  return ws_connected ? ws_client.available() : 0;
+}
+
+size_t transport_read(uint8_t *buffer, size_t size)
+{
+  size_t length = 0;
+  uint8_t incoming;
+
+  while (ws_connected && length < size && ws_client.available())
+  {
+    if (ws_rx_state == WS_RX_PAYLOAD)
+    {
+      // 資料 frame 的 payload 直接讀進呼叫端的 buffer，多個 frame 視為同一個 byte stream
+      size_t chunk = min((uint64_t)(size - length), ws_rx_remaining);
+      chunk = ws_client.read(buffer + length, chunk);
+      length += chunk;
+      ws_rx_remaining -= chunk;
+      if (ws_rx_remaining == 0)
+      {
+        ws_rx_state = WS_RX_HEADER;
+      }
+      continue;
+    }
+
+    incoming = (uint8_t)ws_client.read();
+
+    switch (ws_rx_state)
+    {
+    case WS_RX_HEADER:
+      ws_rx_opcode = incoming & 0x0F;
+      ws_rx_state = WS_RX_LENGTH;
+      break;
+
+    case WS_RX_LENGTH:
+      // server 送來的 frame 不會 mask
+      ws_rx_remaining = incoming & 0x7F;
+      if (ws_rx_remaining >= 126)
+      {
+        ws_rx_length_bytes = ws_rx_remaining == 126 ? 2 : 8;
+        ws_rx_remaining = 0;
+        ws_rx_state = WS_RX_EXTENDED_LENGTH;
+        break;
+      }
+      ws_begin_payload();
+      break;
+
+    case WS_RX_EXTENDED_LENGTH:
+      ws_rx_remaining = (ws_rx_remaining << 8) | incoming;
+      if (--ws_rx_length_bytes == 0)
+      {
+        ws_begin_payload();
+      }
+      break;
+
+    case WS_RX_CONTROL:
+      ws_control_buffer[WS_HEADROOM + ws_rx_control_length++] = incoming;
+      if (ws_rx_control_length == ws_rx_remaining)
+      {
+        ws_control_handler();
+      }
+      break;
+
+    default:
+      ws_rx_state = WS_RX_HEADER;
+      break;
+    }
+  }
+
+  return length;
+}
+
+size_t transport_write(const uint8_t *buffer, size_t size)
+{
+  size_t written = 0;
+
+  if (!ws_connected)
+  {
+    return 0;
+  }
+
+  // 先放進批次 buffer，湊滿或逾時才送出一個 binary message
+  while (written < size)
+  {
+    size_t chunk = min(size - written, (size_t)(WS_BATCH_SIZE - ws_tx_length));
+
+    if (ws_tx_length == 0)
+    {
+      ws_tx_first_ms = millis();
+    }
+    memcpy(ws_tx_buffer + WS_HEADROOM + ws_tx_length, buffer + written, chunk);
+    ws_tx_length += chunk;
+    written += chunk;
+
+    if (ws_tx_length == WS_BATCH_SIZE)
+    {
+      transport_flush();
+    }
+  }
+
+  return written;
+}
+
+void transport_flush()
+{
+  if (!ws_connected || ws_tx_length == 0)
+  {
+    return;
+  }
+
+  ws_send_frame(WS_OPCODE_BINARY, ws_tx_buffer + WS_HEADROOM, ws_tx_length);
+  ws_tx_length = 0;
+}
+
+void transport_loop()
+{
+  if (ws_tx_length && millis() - ws_tx_first_ms >= WS_BATCH_DELAY_MS)
+  {
+    transport_flush();
+  }
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef FAKE_ARDUINO_H
+#define FAKE_ARDUINO_H
+
+// [env:native] 用的最小 Arduino 環境，只提供 transport_ws.cpp 用到的部分
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+
+#define PROGMEM
+#define RANDOM_REG32 fake_random()
+
+inline unsigned long &fake_millis()
+{
+  static unsigned long ms = 0;
+  return ms;
+}
+
+inline unsigned long millis()
+{
+  return fake_millis();
+}
+
+inline uint32_t fake_random()
+{
+  static uint32_t seed = 1;
+  seed = seed * 1103515245 + 12345;
+  return seed;
+}
+
+template <typename T>
+T min(T a, T b)
+{
+  return a < b ? a : b;
+}
+
+class String
+{
+public:
+  std::string s;
+
+  String() {}
+  String(const char *c) : s(c) {}
+  String(const std::string &c) : s(c) {}
+  String &operator=(const char *c)
+  {
+    s = c;
+    return *this;
+  }
+  String &operator+=(const char *c)
+  {
+    s += c;
+    return *this;
+  }
+  String &operator+=(const String &c)
+  {
+    s += c.s;
+    return *this;
+  }
+  int indexOf(const char *c) const
+  {
+    size_t i = s.find(c);
+    return i == std::string::npos ? -1 : (int)i;
+  }
+  unsigned int length() const
+  {
+    return s.length();
+  }
+  const char *c_str() const
+  {
+    return s.c_str();
+  }
+};
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef FAKE_ESP8266WIFI_H
+#define FAKE_ESP8266WIFI_H
+
+#include <Arduino.h>
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef FAKE_WIFICLIENTSECUREBEARSSL_H
+#define FAKE_WIFICLIENTSECUREBEARSSL_H
+
+#include <Arduino.h>
+#include <deque>
+#include <vector>
+
+// 假的 TLS client：server 送來的資料放在 rx，client 送出的資料記在 tx
+namespace BearSSL
+{
+  class Session
+  {
+  };
+
+  class WiFiClientSecure
+  {
+  public:
+    std::deque<uint8_t> rx;
+    std::vector<uint8_t> tx;
+    bool accept = true;
+    bool open = false;
+
+    void setFingerprint(const char *fingerprint) {}
+    void setSession(Session *session) {}
+    void setTimeout(unsigned long timeout_ms) {}
+
+    int connect(const char *host, uint16_t port)
+    {
+      open = accept;
+      return open;
+    }
+    uint8_t connected()
+    {
+      return open || !rx.empty();
+    }
+    void stop()
+    {
+      open = false;
+      rx.clear();
+    }
+
+    int available()
+    {
+      return rx.size();
+    }
+    int read()
+    {
+      if (rx.empty())
+      {
+        return -1;
+      }
+      uint8_t c = rx.front();
+      rx.pop_front();
+      return c;
+    }
+    int read(uint8_t *buffer, size_t size)
+    {
+      size_t n = 0;
+      while (n < size && !rx.empty())
+      {
+        buffer[n++] = read();
+      }
+      return n;
+    }
+
+    size_t write(const uint8_t *buffer, size_t size)
+    {
+      if (!open)
+      {
+        return 0;
+      }
+      tx.insert(tx.end(), buffer, buffer + size);
+      return size;
+    }
+    size_t print(const String &s)
+    {
+      return write((const uint8_t *)s.c_str(), s.length());
+    }
+
+    String readStringUntil(char terminator)
+    {
+      std::string line;
+      int c;
+      while ((c = read()) >= 0 && c != terminator)
+      {
+        line += (char)c;
+      }
+      return String(line);
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef FAKE_BASE64_H
+#define FAKE_BASE64_H
+
+#include <Arduino.h>
+
+class base64
+{
+public:
+  static String encode(const uint8_t *data, size_t length, bool doNewLines = true)
+  {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+
+    for (size_t i = 0; i < length; i += 3)
+    {
+      uint32_t n = data[i] << 16;
+      n |= i + 1 < length ? data[i + 1] << 8 : 0;
+      n |= i + 2 < length ? data[i + 2] : 0;
+      out += table[(n >> 18) & 0x3F];
+      out += table[(n >> 12) & 0x3F];
+      out += i + 1 < length ? table[(n >> 6) & 0x3F] : '=';
+      out += i + 2 < length ? table[n & 0x3F] : '=';
+    }
+    return String(out);
+  }
+};
+
+#endif
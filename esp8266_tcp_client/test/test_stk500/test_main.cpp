@@ -0,0 +1,228 @@
+#include <unity.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+
+#include "stk500.h"
+
+// 假的 optiboot：解析寫入的命令，把回應放進 rx，燒錄到 flash
+#define FLASH_SIZE 32768
+#define IMAGE_SIZE 300
+
+typedef struct
+{
+  uint8_t flash[FLASH_SIZE];
+  uint32_t address;
+  bool progmode;
+  bool left_progmode;
+  // 前幾次 GET_SYNC 不回應（bootloader 還沒開始執行）
+  int sync_ignore;
+  int sync_count;
+  // 燒錄這個位址的頁時寫錯一個 bit，-1 代表不會寫錯
+  long corrupt_address;
+  std::vector<uint8_t> command;
+  std::deque<uint8_t> rx;
+} FakeOptiboot;
+
+FakeOptiboot optiboot;
+uint8_t image[IMAGE_SIZE];
+size_t image_offset;
+
+void optiboot_reply(const uint8_t *response, size_t response_size)
+{
+  optiboot.rx.push_back(STK_INSYNC);
+  optiboot.rx.insert(optiboot.rx.end(), response, response + response_size);
+  optiboot.rx.push_back(STK_OK);
+}
+
+// 收到完整命令（含 CRC_EOP）時回傳命令長度
+size_t optiboot_command_size()
+{
+  std::vector<uint8_t> &command = optiboot.command;
+
+  switch (command[0])
+  {
+  case STK_LOAD_ADDRESS:
+    return 4;
+  case STK_READ_PAGE:
+    return 5;
+  case STK_PROG_PAGE:
+    return command.size() < 3 ? 0 : 5 + ((command[1] << 8) | command[2]);
+  default:
+    return 2;
+  }
+}
+
+void optiboot_handle()
+{
+  std::vector<uint8_t> &command = optiboot.command;
+  uint16_t length;
+
+  if (command.back() != STK_CRC_EOP)
+  {
+    return;
+  }
+
+  switch (command[0])
+  {
+  case STK_GET_SYNC:
+    if (optiboot.sync_count++ >= optiboot.sync_ignore)
+    {
+      optiboot_reply(NULL, 0);
+    }
+    break;
+  case STK_ENTER_PROGMODE:
+    optiboot.progmode = true;
+    optiboot_reply(NULL, 0);
+    break;
+  case STK_LEAVE_PROGMODE:
+    optiboot.left_progmode = true;
+    optiboot_reply(NULL, 0);
+    break;
+  case STK_LOAD_ADDRESS:
+    optiboot.address = (command[1] | (command[2] << 8)) << 1;
+    optiboot_reply(NULL, 0);
+    break;
+  case STK_PROG_PAGE:
+    length = (command[1] << 8) | command[2];
+    TEST_ASSERT_TRUE(optiboot.progmode);
+    memcpy(optiboot.flash + optiboot.address, &command[4], length);
+    if ((long)optiboot.address == optiboot.corrupt_address)
+    {
+      optiboot.flash[optiboot.address] ^= 0x01;
+    }
+    optiboot_reply(NULL, 0);
+    break;
+  case STK_READ_PAGE:
+    length = (command[1] << 8) | command[2];
+    optiboot_reply(optiboot.flash + optiboot.address, length);
+    break;
+  }
+}
+
+int fake_available()
+{
+  return optiboot.rx.size();
+}
+
+int fake_read()
+{
+  if (optiboot.rx.empty())
+  {
+    return -1;
+  }
+  uint8_t c = optiboot.rx.front();
+  optiboot.rx.pop_front();
+  return c;
+}
+
+size_t fake_write(const uint8_t *data, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    optiboot.command.push_back(data[i]);
+    size_t command_size = optiboot_command_size();
+    if (command_size && optiboot.command.size() == command_size)
+    {
+      optiboot_handle();
+      optiboot.command.clear();
+    }
+  }
+  return length;
+}
+
+// 沒有回應時直接當作逾時
+size_t fake_read_bytes(uint8_t *buffer, size_t length, unsigned long timeout_ms)
+{
+  size_t n = 0;
+  while (n < length && !optiboot.rx.empty())
+  {
+    buffer[n++] = fake_read();
+  }
+  return n;
+}
+
+size_t read_image(uint8_t *buffer, size_t size)
+{
+  size_t length = IMAGE_SIZE - image_offset < size ? IMAGE_SIZE - image_offset : size;
+  memcpy(buffer, image + image_offset, length);
+  image_offset += length;
+  return length;
+}
+
+Stk500Port port = {fake_available, fake_read, fake_write, fake_read_bytes};
+
+void setUp()
+{
+  optiboot = FakeOptiboot();
+  memset(optiboot.flash, 0, FLASH_SIZE);
+  optiboot.corrupt_address = -1;
+  for (int i = 0; i < IMAGE_SIZE; i++)
+  {
+    image[i] = i * 7 + 3;
+  }
+  image_offset = 0;
+}
+
+void tearDown()
+{
+}
+
+void test_flash_image()
+{
+  TEST_ASSERT_TRUE(stk500_flash(&port, read_image, IMAGE_SIZE));
+  TEST_ASSERT_EQUAL_MEMORY(image, optiboot.flash, IMAGE_SIZE);
+  // 最後一頁不足的部分補 0xFF，之後的 flash 不會動到
+  for (int i = IMAGE_SIZE; i < 3 * STK500_PAGE_SIZE; i++)
+  {
+    TEST_ASSERT_EQUAL(0xFF, optiboot.flash[i]);
+  }
+  TEST_ASSERT_EQUAL(0, optiboot.flash[3 * STK500_PAGE_SIZE]);
+  TEST_ASSERT_TRUE(optiboot.left_progmode);
+}
+
+void test_sync_retry()
+{
+  optiboot.sync_ignore = STK500_SYNC_RETRY - 1;
+  TEST_ASSERT_TRUE(stk500_flash(&port, read_image, IMAGE_SIZE));
+  TEST_ASSERT_EQUAL(STK500_SYNC_RETRY, optiboot.sync_count);
+  TEST_ASSERT_EQUAL_MEMORY(image, optiboot.flash, IMAGE_SIZE);
+}
+
+void test_sync_failed()
+{
+  optiboot.sync_ignore = STK500_SYNC_RETRY;
+  TEST_ASSERT_FALSE(stk500_flash(&port, read_image, IMAGE_SIZE));
+  TEST_ASSERT_EQUAL(STK500_SYNC_RETRY, optiboot.sync_count);
+  TEST_ASSERT_FALSE(optiboot.progmode);
+}
+
+void test_readback_mismatch()
+{
+  optiboot.corrupt_address = STK500_PAGE_SIZE;
+  TEST_ASSERT_FALSE(stk500_flash(&port, read_image, IMAGE_SIZE));
+  // 比對失敗後不再燒錄之後的頁
+  TEST_ASSERT_EQUAL(2 * STK500_PAGE_SIZE, image_offset);
+  TEST_ASSERT_TRUE(optiboot.left_progmode);
+}
+
+void test_stale_response_discarded()
+{
+  // 上一個命令逾時後才到的回應
+  uint8_t command = STK_GET_SYNC;
+  optiboot.rx.push_back(STK_INSYNC);
+  optiboot.rx.push_back(0x00);
+  TEST_ASSERT_TRUE(stk500_command(&port, &command, 1, NULL, 0, NULL, 0));
+  TEST_ASSERT_EQUAL(0, optiboot.rx.size());
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_flash_image);
+  RUN_TEST(test_sync_retry);
+  RUN_TEST(test_sync_failed);
+  RUN_TEST(test_readback_mismatch);
+  RUN_TEST(test_stale_response_discarded);
+  return UNITY_END();
+}
@@ -0,0 +1,173 @@
+#include <unity.h>
+#include <WiFiClientSecureBearSSL.h>
+#include <vector>
+
+#include "transport.h"
+
+// 以假的 TLS client 代替 server，檢查 WebSocket 的 handshake、frame 和關閉連線
+#define HANDSHAKE_RESPONSE "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n\r\n"
+
+extern BearSSL::WiFiClientSecure ws_client;
+
+void server_send(const char *data)
+{
+  ws_client.rx.insert(ws_client.rx.end(), data, data + strlen(data));
+}
+
+void server_send_frame(uint8_t opcode, const uint8_t *payload, size_t length)
+{
+  ws_client.rx.push_back(0x80 | opcode);
+  ws_client.rx.push_back(length);
+  ws_client.rx.insert(ws_client.rx.end(), payload, payload + length);
+}
+
+// 解開 client 送出的第一個 frame，回傳 opcode 並從 tx 移除，沒有 mask 時回傳 -1
+int client_frame(std::vector<uint8_t> &payload)
+{
+  std::vector<uint8_t> &tx = ws_client.tx;
+  size_t header_size = 2;
+  size_t length;
+
+  // client 送出的 frame 一定要 mask
+  if (tx.size() < 2 || !(tx[1] & 0x80))
+  {
+    return -1;
+  }
+  length = tx[1] & 0x7F;
+  if (length == 126)
+  {
+    length = (tx[2] << 8) | tx[3];
+    header_size += 2;
+  }
+
+  uint8_t *mask = &tx[header_size];
+  payload.clear();
+  for (size_t i = 0; i < length; i++)
+  {
+    payload.push_back(tx[header_size + 4 + i] ^ mask[i & 3]);
+  }
+
+  int opcode = tx[0] & 0x0F;
+  tx.erase(tx.begin(), tx.begin() + header_size + 4 + length);
+  return opcode;
+}
+
+void connect()
+{
+  server_send(HANDSHAKE_RESPONSE);
+  TEST_ASSERT_TRUE(transport_connect("example.com", 443, "Token: abc\r\n"));
+  ws_client.tx.clear();
+}
+
+void setUp()
+{
+  ws_client = BearSSL::WiFiClientSecure();
+  fake_millis() = 0;
+}
+
+void tearDown()
+{
+  transport_stop();
+}
+
+void test_handshake()
+{
+  server_send(HANDSHAKE_RESPONSE);
+  TEST_ASSERT_TRUE(transport_connect("example.com", 443, "Token: abc\r\n"));
+  TEST_ASSERT_TRUE(transport_connected());
+
+  std::string request(ws_client.tx.begin(), ws_client.tx.end());
+  TEST_ASSERT_EQUAL(0, request.find("GET "));
+  TEST_ASSERT_TRUE(request.find("Upgrade: websocket\r\n") != std::string::npos);
+  TEST_ASSERT_TRUE(request.find("\r\nToken: abc\r\n\r\n") != std::string::npos);
+}
+
+void test_handshake_rejected()
+{
+  server_send("HTTP/1.1 403 Forbidden\r\n\r\n");
+  TEST_ASSERT_FALSE(transport_connect("example.com", 443, ""));
+  TEST_ASSERT_FALSE(transport_connected());
+}
+
+void test_read_frames_as_stream()
+{
+  uint8_t first[] = {1, 2, 3};
+  uint8_t second[] = {4, 5};
+  uint8_t buffer[16];
+
+  connect();
+  server_send_frame(0x2, first, sizeof(first));
+  server_send_frame(0x2, second, sizeof(second));
+
+  TEST_ASSERT_EQUAL(5, transport_read(buffer, sizeof(buffer)));
+  uint8_t expected[] = {1, 2, 3, 4, 5};
+  TEST_ASSERT_EQUAL_MEMORY(expected, buffer, 5);
+}
+
+void test_write_batched()
+{
+  uint8_t first[] = {1, 2, 3};
+  uint8_t second[] = {4, 5};
+  std::vector<uint8_t> payload;
+
+  connect();
+  transport_write(first, sizeof(first));
+  transport_write(second, sizeof(second));
+  transport_loop();
+  // 還沒到批次的等待時間
+  TEST_ASSERT_EQUAL(0, ws_client.tx.size());
+
+  fake_millis() += 20;
+  transport_loop();
+  TEST_ASSERT_EQUAL(0x2, client_frame(payload));
+  TEST_ASSERT_EQUAL(5, payload.size());
+  uint8_t expected[] = {1, 2, 3, 4, 5};
+  TEST_ASSERT_EQUAL_MEMORY(expected, payload.data(), 5);
+  TEST_ASSERT_EQUAL(0, ws_client.tx.size());
+}
+
+void test_ping_pong()
+{
+  uint8_t ping[] = {'h', 'i'};
+  uint8_t data[] = {7};
+  uint8_t buffer[16];
+  std::vector<uint8_t> payload;
+
+  connect();
+  server_send_frame(0x9, ping, sizeof(ping));
+  server_send_frame(0x2, data, sizeof(data));
+
+  // control frame 不會出現在資料裡
+  TEST_ASSERT_EQUAL(1, transport_read(buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL(7, buffer[0]);
+  TEST_ASSERT_EQUAL(0xA, client_frame(payload));
+  TEST_ASSERT_EQUAL(2, payload.size());
+  TEST_ASSERT_EQUAL_MEMORY(ping, payload.data(), 2);
+}
+
+void test_server_close()
+{
+  uint8_t buffer[16];
+  std::vector<uint8_t> payload;
+
+  connect();
+  server_send_frame(0x8, NULL, 0);
+
+  TEST_ASSERT_EQUAL(0, transport_read(buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL(0x8, client_frame(payload));
+  // main.cpp 依這個結果關閉連線並重新連線
+  TEST_ASSERT_FALSE(transport_connected());
+  TEST_ASSERT_EQUAL(0, transport_available());
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_handshake);
+  RUN_TEST(test_handshake_rejected);
+  RUN_TEST(test_read_frames_as_stream);
+  RUN_TEST(test_write_batched);
+  RUN_TEST(test_ping_pong);
+  RUN_TEST(test_server_close);
+  return UNITY_END();
+}
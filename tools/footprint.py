@@ -0,0 +1,109 @@
+# PlatformIO post-build script: RAM/flash footprint report with regression thresholds.
+#
+# Usage in platformio.ini:
+#
+#   extra_scripts = post:../tools/footprint.py
+#   custom_footprint_max_ram = 1536      ; .data + .rodata + .bss + .noinit (bytes)
+#   custom_footprint_max_flash = 30720   ; .text + .data + .rodata + .irom0.text (bytes)
+#   custom_footprint_top = 10            ; largest symbols listed per section class
+#
+# The report is printed after linking and written to $BUILD_DIR/footprint.txt.
+# The build fails when a threshold is exceeded.
+
+import subprocess
+
+Import("env")
+
+RAM_SECTIONS = (".data", ".rodata", ".bss", ".noinit")
+FLASH_SECTIONS = (".text", ".data", ".rodata", ".irom0.text")
+
+# nm symbol type -> section class
+SYMBOL_CLASSES = {
+    "t": ".text",
+    "w": ".text",
+    "d": ".data",
+    "r": ".rodata",
+    "b": ".bss",
+    "v": ".bss",
+}
+
+
+def get_tool(name):
+    # avr-size -> avr-nm, xtensa-lx106-elf-size -> xtensa-lx106-elf-nm
+    size_tool = env.subst("$SIZETOOL")
+    return size_tool[: -len("size")] + name
+
+
+def get_option(name, default=None):
+    value = env.GetProjectOption("custom_footprint_" + name, default)
+    return int(value) if value is not None else None
+
+
+def read_sections(elf):
+    output = subprocess.check_output([get_tool("size"), "-A", elf], text=True)
+    sections = {}
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[0].startswith(".") and fields[1].isdigit():
+            sections[fields[0]] = int(fields[1])
+    return sections
+
+
+def read_symbols(elf):
+    output = subprocess.check_output(
+        [get_tool("nm"), "--size-sort", "--print-size", "--demangle", elf], text=True
+    )
+    symbols = {}
+    for line in output.splitlines():
+        fields = line.split(None, 3)
+        if len(fields) < 4:
+            continue
+        section = SYMBOL_CLASSES.get(fields[2].lower())
+        if section is None:
+            continue
+        symbols.setdefault(section, []).append((int(fields[1], 16), fields[3]))
+    return symbols
+
+
+def footprint_report(source, target, env):
+    elf = str(source[0])
+    sections = read_sections(elf)
+    symbols = read_symbols(elf)
+
+    ram = sum(sections.get(name, 0) for name in RAM_SECTIONS)
+    flash = sum(sections.get(name, 0) for name in FLASH_SECTIONS)
+    max_ram = get_option("max_ram")
+    max_flash = get_option("max_flash")
+    top = get_option("top", 10)
+
+    lines = ["Footprint report [%s]" % env.subst("$PIOENV")]
+    for name in sorted(sections):
+        lines.append("  %-16s %8d" % (name, sections[name]))
+    lines.append("  %-16s %8d / %s" % ("RAM", ram, max_ram if max_ram else "-"))
+    lines.append("  %-16s %8d / %s" % ("flash", flash, max_flash if max_flash else "-"))
+
+    for section in (".text", ".rodata", ".data", ".bss"):
+        entries = sorted(symbols.get(section, []), reverse=True)[:top]
+        if not entries:
+            continue
+        lines.append("  largest %s symbols:" % section)
+        for size, name in entries:
+            lines.append("    %8d  %s" % (size, name))
+
+    report = "\n".join(lines)
+    print(report)
+    with open(env.subst("$BUILD_DIR/footprint.txt"), "w") as fp:
+        fp.write(report + "\n")
+
+    failed = False
+    if max_ram and ram > max_ram:
+        print("Error: RAM footprint %d exceeds custom_footprint_max_ram=%d" % (ram, max_ram))
+        failed = True
+    if max_flash and flash > max_flash:
+        print("Error: flash footprint %d exceeds custom_footprint_max_flash=%d" % (flash, max_flash))
+        failed = True
+    if failed:
+        env.Exit(1)
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", footprint_report)
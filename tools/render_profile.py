@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""Render loop() stage histograms dumped with OPCODE_SERVER_DEBUG_GET_PROFILE.
+
+The input is one frame as received by the server: the opcode byte
+(116 = arduino_controller, 126 = esp8266_tcp_client) followed by the payload
+
+    stage_count u8, bucket_count u8, bucket_shift u8, counter_size u8,
+    ticks_per_us u8, counts[stage_count][bucket_count] (little endian)
+
+Usage:
+    render_profile.py frame.bin
+    render_profile.py --hex "7e 04 10 06 04 50 ..."
+"""
+
+import argparse
+import sys
+
+OPCODE_CLIENT_SUBMIT_PROFILE = 116
+OPCODE_ESP8266_PROFILE = 126
+
+STAGE_NAMES = {
+    OPCODE_CLIENT_SUBMIT_PROFILE: ("loop", "parse", "get_M", "serial write"),
+    OPCODE_ESP8266_PROFILE: ("loop", "tcp read", "serial read", "tcp write"),
+}
+
+BAR_WIDTH = 40
+
+
+def format_us(us):
+    if us >= 1000:
+        return "%.1f ms" % (us / 1000)
+    return "%.1f us" % us
+
+
+def parse_frame(frame):
+    opcode = frame[0]
+    if opcode not in STAGE_NAMES:
+        raise ValueError("unexpected opcode %d" % opcode)
+    stage_count, bucket_count, bucket_shift, counter_size, ticks_per_us = frame[1:6]
+    counts = frame[6:]
+    expected = stage_count * bucket_count * counter_size
+    if len(counts) < expected:
+        raise ValueError("truncated frame: %d of %d count bytes" % (len(counts), expected))
+
+    histograms = []
+    for stage in range(stage_count):
+        buckets = []
+        for bucket in range(bucket_count):
+            offset = (stage * bucket_count + bucket) * counter_size
+            buckets.append(int.from_bytes(counts[offset : offset + counter_size], "little"))
+        histograms.append(buckets)
+    return opcode, bucket_shift, ticks_per_us, histograms
+
+
+def render(frame, out=sys.stdout):
+    opcode, bucket_shift, ticks_per_us, histograms = parse_frame(frame)
+    names = STAGE_NAMES[opcode]
+
+    for stage, buckets in enumerate(histograms):
+        name = names[stage] if stage < len(names) else "stage %d" % stage
+        total = sum(buckets)
+        out.write("%s (%d samples)\n" % (name, total))
+        if not total:
+            continue
+        peak = max(buckets)
+        for bucket, count in enumerate(buckets):
+            if not count:
+                continue
+            low = (1 << (bucket + bucket_shift)) / ticks_per_us if bucket else 0
+            high = (1 << (bucket + bucket_shift + 1)) / ticks_per_us
+            bar = "#" * max(1, count * BAR_WIDTH // peak)
+            out.write(
+                "  %10s - %-10s %8d  %s\n" % (format_us(low), format_us(high), count, bar)
+            )
+        out.write("\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("file", nargs="?", help="binary frame file")
+    parser.add_argument("--hex", help="frame as hex string")
+    args = parser.parse_args()
+
+    if args.hex:
+        frame = bytes.fromhex(args.hex)
+    elif args.file:
+        with open(args.file, "rb") as fp:
+            frame = fp.read()
+    else:
+        parser.error("either a frame file or --hex is required")
+
+    render(frame)
+
+
+if __name__ == "__main__":
+    main()
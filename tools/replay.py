@@ -0,0 +1,283 @@
+#!/usr/bin/env python3
+"""Replay link captures recorded by esp8266_tcp_client built with -D CAPTURE_LINKS.
+
+A capture starts with "CO3C" + version u8, followed by records
+
+    t_ms u32, link u8, length u16, data[length] (little endian)
+
+where link is 0 = serial rx, 1 = serial tx, 2 = TCP rx, 3 = TCP tx,
+4 = TCP open, 5 = TCP close (rx/tx as seen by the bridge). The files are
+/capture.bin (this boot) and /capture.old.bin (previous boot) on LittleFS;
+OPCODE_SERVER_DEBUG_GET_CAPTURE (134) [file u8] streams them back as
+OPCODE_ESP8266_CAPTURE (135) frames: offset u32, length u16, data, ending
+with a zero length frame.
+
+Usage:
+    replay.py dump capture.bin
+    replay.py serial capture.bin --device /dev/ttyUSB0 [--link tx|rx]
+    replay.py tcp capture.bin --host 127.0.0.1 --port 9453 [--clients 50 --repeat 10]
+    replay.py server capture.bin --port 9453
+
+serial feeds the serial traffic into a board: tx (default) is what the
+bridge sent, so it drives an arduino_controller; rx is what the controller
+sent, so it drives a bridge. tcp plays the bridge against a server, and
+with --clients it becomes a load generator; when more than one device is
+replayed, each client and repeat presents its own CO3006-Name (a locally
+administered MAC derived from the client index and repeat number) so the
+server sees distinct devices. server plays the server
+against a connecting bridge. --speed scales time from 1x up to 1000x.
+"""
+
+import argparse
+import re
+import socket
+import struct
+import sys
+import threading
+import time
+
+MAGIC = b"CO3C"
+VERSION = 1
+RECORD_HEADER = struct.Struct("<IBH")
+
+SERIAL_RX = 0
+SERIAL_TX = 1
+TCP_RX = 2
+TCP_TX = 3
+TCP_OPEN = 4
+TCP_CLOSE = 5
+
+NAME_HEADER = re.compile(rb"(CO3006-Name: )[^\r\n]*")
+
+LINK_NAMES = {
+    SERIAL_RX: "serial rx",
+    SERIAL_TX: "serial tx",
+    TCP_RX: "tcp rx",
+    TCP_TX: "tcp tx",
+    TCP_OPEN: "tcp open",
+    TCP_CLOSE: "tcp close",
+}
+
+
+def read_capture(path):
+    with open(path, "rb") as fp:
+        data = fp.read()
+    if data[:4] != MAGIC:
+        raise ValueError("%s is not a capture file" % path)
+    if data[4] != VERSION:
+        raise ValueError("unsupported capture version %d" % data[4])
+
+    records = []
+    offset = 5
+    while offset + RECORD_HEADER.size <= len(data):
+        t_ms, link, length = RECORD_HEADER.unpack_from(data, offset)
+        offset += RECORD_HEADER.size
+        if offset + length > len(data):
+            # 斷電時最後一筆可能不完整
+            sys.stderr.write("truncated record at t=%d ms\n" % t_ms)
+            break
+        records.append((t_ms, link, data[offset : offset + length]))
+        offset += length
+    return records
+
+
+def sessions(records):
+    """Split TCP records into one list per connection."""
+    current = []
+    for record in records:
+        link = record[1]
+        if link == TCP_OPEN:
+            if current:
+                yield current
+            current = []
+        elif link in (TCP_RX, TCP_TX):
+            current.append(record)
+    if current:
+        yield current
+
+
+class Pacer:
+    """Sleep until each record is due, time scaled by speed."""
+
+    def __init__(self, speed):
+        self.speed = speed
+        self.origin = None
+        self.start = None
+        self.max_lag = 0.0
+
+    def wait(self, t_ms):
+        now = time.monotonic()
+        if self.origin is None:
+            self.origin = t_ms
+            self.start = now
+        due = self.start + (t_ms - self.origin) / 1000.0 / self.speed
+        if due > now:
+            time.sleep(due - now)
+        else:
+            self.max_lag = max(self.max_lag, now - due)
+
+
+def drain(sock):
+    """Discard whatever the peer sends so it never blocks on a full window."""
+    try:
+        while sock.recv(4096):
+            pass
+    except OSError:
+        pass
+
+
+def dump(records, out=sys.stdout):
+    for t_ms, link, data in records:
+        out.write("%10d  %-9s %5d  %s\n" % (t_ms, LINK_NAMES.get(link, "link %d" % link), len(data), data[:32].hex(" ")))
+
+
+def replay_serial(records, args):
+    try:
+        import serial
+    except ImportError:
+        sys.exit("pyserial is required: pip install pyserial")
+
+    link = SERIAL_TX if args.link == "tx" else SERIAL_RX
+    port = serial.Serial(args.device, args.baud)
+    pacer = Pacer(args.speed)
+    sent = 0
+    for t_ms, record_link, data in records:
+        if record_link != link:
+            continue
+        pacer.wait(t_ms)
+        port.write(data)
+        sent += len(data)
+    port.flush()
+    port.close()
+    return sent, pacer.max_lag
+
+
+def replay_session(session, sock, speed):
+    pacer = Pacer(speed)
+    sent = 0
+    for t_ms, link, data in session:
+        if link != TCP_TX:
+            continue
+        pacer.wait(t_ms)
+        sock.sendall(data)
+        sent += len(data)
+    return sent, pacer.max_lag
+
+
+def device_mac(client, repeat):
+    """Locally administered MAC unique to one client and repeat."""
+    return "02:%02X:%02X:%02X:%02X:%02X" % (client >> 8 & 0xFF, client & 0xFF, repeat >> 16 & 0xFF, repeat >> 8 & 0xFF, repeat & 0xFF)
+
+
+def rename_device(session, mac):
+    """Rewrite CO3006-Name in the auth header, the first TCP tx record."""
+    session = list(session)
+    for i, (t_ms, link, data) in enumerate(session):
+        if link == TCP_TX:
+            session[i] = (t_ms, link, NAME_HEADER.sub(lambda m: m.group(1) + mac.encode(), data, count=1))
+            break
+    return session
+
+
+def replay_client(records, args, stats, lock, client):
+    all_sessions = list(sessions(records))
+    for repeat in range(args.repeat):
+        if args.clients * args.repeat > 1:
+            mac = device_mac(client, repeat)
+            client_sessions = [rename_device(session, mac) for session in all_sessions]
+        else:
+            client_sessions = all_sessions
+        for session in client_sessions:
+            sock = socket.create_connection((args.host, args.port))
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=drain, args=(sock,), daemon=True).start()
+            try:
+                sent, lag = replay_session(session, sock, args.speed)
+            finally:
+                sock.close()
+            with lock:
+                stats["bytes"] += sent
+                stats["sessions"] += 1
+                stats["max_lag"] = max(stats["max_lag"], lag)
+
+
+def replay_tcp(records, args):
+    stats = {"bytes": 0, "sessions": 0, "max_lag": 0.0}
+    lock = threading.Lock()
+    threads = [
+        threading.Thread(target=replay_client, args=(records, args, stats, lock, client))
+        for client in range(args.clients)
+    ]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    sys.stderr.write("%d sessions\n" % stats["sessions"])
+    return stats["bytes"], stats["max_lag"]
+
+
+def replay_server(records, args):
+    listener = socket.create_server(("", args.port))
+    sys.stderr.write("waiting for the bridge on port %d\n" % args.port)
+    sent = 0
+    max_lag = 0.0
+    for session in sessions(records):
+        sock, address = listener.accept()
+        sys.stderr.write("bridge connected from %s\n" % address[0])
+        threading.Thread(target=drain, args=(sock,), daemon=True).start()
+        # 重播 server 送出的資料
+        pacer = Pacer(args.speed)
+        for t_ms, link, data in session:
+            if link != TCP_RX:
+                continue
+            pacer.wait(t_ms)
+            sock.sendall(data)
+            sent += len(data)
+        max_lag = max(max_lag, pacer.max_lag)
+        sock.close()
+    listener.close()
+    return sent, max_lag
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("mode", choices=("dump", "serial", "tcp", "server"))
+    parser.add_argument("file", help="capture file")
+    parser.add_argument("--speed", type=float, default=1.0, help="1 to 1000, default 1")
+    parser.add_argument("--device", help="serial device")
+    parser.add_argument("--baud", type=int, default=9600)
+    parser.add_argument("--link", choices=("tx", "rx"), default="tx", help="serial direction to replay")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=9453)
+    parser.add_argument("--clients", type=int, default=1, help="concurrent TCP clients")
+    parser.add_argument("--repeat", type=int, default=1, help="times each client replays the capture")
+    args = parser.parse_args()
+
+    if not 1 <= args.speed <= 1000:
+        parser.error("--speed must be between 1 and 1000")
+
+    records = read_capture(args.file)
+
+    if args.mode == "dump":
+        dump(records)
+        return
+    if args.mode == "serial":
+        if not args.device:
+            parser.error("serial mode requires --device")
+        replay = replay_serial
+    elif args.mode == "tcp":
+        replay = replay_tcp
+    else:
+        replay = replay_server
+
+    start = time.monotonic()
+    sent, max_lag = replay(records, args)
+    elapsed = time.monotonic() - start
+    sys.stderr.write(
+        "sent %d bytes in %.2f s (%.1f kB/s), max lag %.1f ms\n"
+        % (sent, elapsed, sent / 1000 / elapsed if elapsed else 0, max_lag * 1000)
+    )
+
+
+if __name__ == "__main__":
+    main()